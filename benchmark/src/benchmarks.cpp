@@ -0,0 +1,559 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+// Microbenchmarks for the queues, thread pool and pipelines. Prints a JSON
+// report to stdout, or the file given with --out, so results can be compared
+// between releases.
+//
+// Usage: benchmarks [--filter <substring>] [--repetitions <n>] [--quick]
+//                   [--out <file>]
+
+#include <psp/pipeline.hpp>
+#include <psp/reduce.hpp>
+#include <psp/ring_buffer.hpp>
+#include <psp/stream_processor.hpp>
+#include <psp/stream_queue.hpp>
+#include <psp/thread_pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace psp;
+using benchmark_clock = std::chrono::steady_clock;
+
+namespace {
+
+struct settings {
+    std::string filter;
+    int repetitions{3};
+    bool quick{false};
+};
+
+// One measurement. Counters are extra values, e.g. latency percentiles,
+// reported alongside the timing.
+struct sample {
+    double seconds{0.0};
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+struct result {
+    std::string name;
+    std::string group;
+    std::vector<std::pair<std::string, std::string>> parameters;
+    std::size_t items{0};
+    std::vector<sample> samples;
+};
+
+class benchmark_suite {
+public:
+    explicit benchmark_suite(settings s) : m_settings(std::move(s)) {}
+
+    std::size_t scale(std::size_t full) const {
+        return m_settings.quick ? std::max<std::size_t>(full / 10, 1) : full;
+    }
+
+    // Runs body repetitions times if name matches the filter. body processes
+    // items items and returns the sample.
+    void run(const std::string &group,
+             std::vector<std::pair<std::string, std::string>> parameters,
+             std::size_t items, const std::function<sample()> &body) {
+        std::string name = group;
+        for (auto &parameter : parameters)
+            name += "/" + parameter.first + ":" + parameter.second;
+        if (name.find(m_settings.filter) == std::string::npos)
+            return;
+        fprintf(stderr, "%s\n", name.c_str());
+        result r{name, group, std::move(parameters), items, {}};
+        for (int i = 0; i < m_settings.repetitions; ++i)
+            r.samples.push_back(body());
+        m_results.push_back(std::move(r));
+    }
+
+    void write_json(FILE *out) const {
+        fprintf(out, "{\n  \"context\": {\n");
+        fprintf(out, "    \"hardware_concurrency\": %u,\n",
+                std::thread::hardware_concurrency());
+        fprintf(out, "    \"compiler\": \"%s\",\n", escape(compiler()).c_str());
+        fprintf(out, "    \"repetitions\": %d,\n", m_settings.repetitions);
+        fprintf(out, "    \"quick\": %s\n", m_settings.quick ? "true" : "false");
+        fprintf(out, "  },\n  \"benchmarks\": [");
+        for (std::size_t i = 0; i < m_results.size(); ++i) {
+            const result &r = m_results[i];
+            std::vector<double> seconds;
+            for (auto &s : r.samples)
+                seconds.push_back(s.seconds);
+            std::sort(seconds.begin(), seconds.end());
+            double median = seconds[seconds.size() / 2];
+            fprintf(out, "%s\n    {\n", i ? "," : "");
+            fprintf(out, "      \"name\": \"%s\",\n", escape(r.name).c_str());
+            fprintf(out, "      \"group\": \"%s\",\n", escape(r.group).c_str());
+            fprintf(out, "      \"parameters\": {");
+            for (std::size_t j = 0; j < r.parameters.size(); ++j)
+                fprintf(out, "%s\"%s\": \"%s\"", j ? ", " : "",
+                        escape(r.parameters[j].first).c_str(),
+                        escape(r.parameters[j].second).c_str());
+            fprintf(out, "},\n");
+            fprintf(out, "      \"items\": %zu,\n", r.items);
+            fprintf(out, "      \"median_seconds\": %.9g,\n", median);
+            fprintf(out, "      \"min_seconds\": %.9g,\n", seconds.front());
+            fprintf(out, "      \"max_seconds\": %.9g,\n", seconds.back());
+            fprintf(out, "      \"ns_per_item\": %.6g,\n",
+                    median * 1e9 / double(r.items));
+            fprintf(out, "      \"items_per_second\": %.6g",
+                    double(r.items) / median);
+
+            // Counters are reported from the median sample
+            const sample *mid = &r.samples.front();
+            for (auto &s : r.samples)
+                if (s.seconds == median)
+                    mid = &s;
+            for (auto &counter : mid->counters)
+                fprintf(out, ",\n      \"%s\": %.6g",
+                        escape(counter.first).c_str(), counter.second);
+            fprintf(out, "\n    }");
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+
+private:
+    static std::string compiler() {
+#if defined(__clang__)
+        return "clang " __clang_version__;
+#elif defined(__GNUC__)
+        return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+        return "msvc " + std::to_string(_MSC_VER);
+#else
+        return "unknown";
+#endif
+    }
+
+    static std::string escape(const std::string &s) {
+        std::string result;
+        for (char c : s) {
+            if (c == '"' || c == '\\')
+                result += '\\';
+            result += c;
+        }
+        return result;
+    }
+
+    settings m_settings;
+    std::vector<result> m_results;
+};
+
+double seconds_since(benchmark_clock::time_point start) {
+    return std::chrono::duration<double>(benchmark_clock::now() - start)
+        .count();
+}
+
+// Busy work standing in for the per item cost of a real stage function
+int spin(int value, int iterations) {
+    std::uint32_t x = std::uint32_t(value) | 1u;
+    for (int i = 0; i < iterations; ++i)
+        x = x * 1664525u + 1013904223u;
+    return int(x >> 1);
+}
+
+// A functor rather than a function, as function_traits needs operator()
+struct collatz_step {
+    int operator()(int x) const {
+        if (x <= 1)
+            return 0;
+        return (x & 1) ? 3 * x + 1 : x / 2;
+    }
+};
+
+// Branch free collatz step, so a loop of them over many items vectorizes
+inline int collatz_select(int x) {
+    int next = (x & 1) ? 3 * x + 1 : x >> 1;
+    return x <= 1 ? 0 : next;
+}
+
+// steps collatz steps per item, with a function call per item
+sample collatz_items(const std::vector<int> &input, std::size_t threadCount,
+                     int steps) {
+    auto start = benchmark_clock::now();
+    parallel_streams runner(
+        input.begin(), input.end(),
+        [steps](int x) {
+            for (int s = 0; s < steps; ++s)
+                x = collatz_select(x);
+            return x;
+        },
+        threadCount);
+    long long sum = 0;
+    for (int item : runner)
+        sum += item;
+    return {seconds_since(start), {{"checksum", double(sum)}}};
+}
+
+// The same steps with batch_map, stepping a whole batch at a time so the
+// inner loop is vectorized, e.g. with AVX2 given PSP_BENCHMARK_AVX2
+sample collatz_batches(const std::vector<int> &input, std::size_t threadCount,
+                       int steps) {
+    auto start = benchmark_clock::now();
+    parallel_streams runner(
+        input.begin(), input.end(),
+        batch_map([steps](span<const int> in, span<int> out) {
+            std::copy(in.begin(), in.end(), out.begin());
+            for (int s = 0; s < steps; ++s)
+                for (std::size_t i = 0; i < out.size(); ++i)
+                    out[i] = collatz_select(out[i]);
+        }),
+        threadCount);
+    long long sum = 0;
+    for (int item : runner)
+        sum += item;
+    return {seconds_since(start), {{"checksum", double(sum)}}};
+}
+
+// Items pushed by producers threads and popped by consumers threads
+template <class Buffer>
+sample queue_throughput(std::size_t items, int producers, int consumers) {
+    stream_queue<int, Buffer> queue;
+    std::atomic<std::size_t> popped{0};
+    auto start = benchmark_clock::now();
+    std::vector<std::thread> threads;
+    {
+        std::vector<typename stream_queue<int, Buffer>::writer> writers;
+        for (int p = 0; p < producers; ++p)
+            writers.push_back(queue.make_writer());
+        for (int p = 0; p < producers; ++p)
+            threads.emplace_back(
+                [&, p, writer = std::move(writers[p])]() mutable {
+                    std::size_t count = items / producers +
+                                        (std::size_t(p) < items % producers);
+                    for (std::size_t i = 0; i < count; ++i)
+                        writer.push(int(i));
+                });
+    }
+    for (int c = 0; c < consumers; ++c)
+        threads.emplace_back([&] {
+            std::size_t count = 0;
+            while (queue.pop())
+                ++count;
+            popped += count;
+        });
+    for (auto &thread : threads)
+        thread.join();
+    sample s{seconds_since(start), {}};
+    if (popped != items)
+        fprintf(stderr, "queue_throughput: lost items\n");
+    return s;
+}
+
+// Round trips through a pair of queues, one item in flight at a time
+template <class Buffer> sample queue_latency(std::size_t items) {
+    stream_queue<int, Buffer> ping;
+    stream_queue<int, Buffer> pong;
+    auto pongWriter = pong.make_writer();
+    std::thread echo([&ping, writer = std::move(pongWriter)]() mutable {
+        while (auto item = ping.pop())
+            writer.push(*item);
+    });
+    std::vector<double> latencies;
+    latencies.reserve(items);
+    auto start = benchmark_clock::now();
+    {
+        auto writer = ping.make_writer();
+        for (std::size_t i = 0; i < items; ++i) {
+            auto sent = benchmark_clock::now();
+            writer.push(int(i));
+            pong.pop();
+            latencies.push_back(
+                std::chrono::duration<double, std::nano>(
+                    benchmark_clock::now() - sent)
+                    .count());
+        }
+    }
+    sample s{seconds_since(start), {}};
+    echo.join();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies[std::min(latencies.size() - 1,
+                                  std::size_t(p * double(latencies.size())))];
+    };
+    s.counters = {{"round_trip_p50_ns", percentile(0.5)},
+                  {"round_trip_p99_ns", percentile(0.99)},
+                  {"round_trip_max_ns", latencies.back()}};
+    return s;
+}
+
+// Total calls to tasks trivial multitasks that each return ready until the
+// shared budget runs out
+sample pool_dispatch(std::size_t calls, std::size_t threadCount,
+                     std::size_t tasks) {
+    std::atomic<std::int64_t> remaining{std::int64_t(calls)};
+    std::atomic<std::size_t> finished{0};
+    auto start = benchmark_clock::now();
+    {
+        thread_pool threads(threadCount);
+        for (std::size_t t = 0; t < tasks; ++t)
+            threads.process([&]() {
+                if (remaining.fetch_sub(1, std::memory_order_relaxed) > 0)
+                    return task_status::ready;
+                ++finished;
+                return task_status::finished;
+            });
+        while (finished.load() < tasks)
+            std::this_thread::yield();
+    }
+    return {seconds_since(start), {}};
+}
+
+sample parallel_streams_scaling(const std::vector<int> &input,
+                                std::size_t threadCount, int cost) {
+    auto start = benchmark_clock::now();
+    parallel_streams runner(
+        input.begin(), input.end(), [cost](int i) { return spin(i, cost); },
+        threadCount);
+    long long sum = 0;
+    for (int item : runner)
+        sum += item;
+    sample s{seconds_since(start), {}};
+    s.counters = {{"checksum", double(sum & 0xffff)}};
+    return s;
+}
+
+// StressPipeline: every collatz step is its own stage
+sample deep_pipeline_threads(const std::vector<int> &input, int length) {
+    auto start = benchmark_clock::now();
+    parallel_streams first(input.begin(), input.end(), collatz_step{}, 1);
+    using Processor =
+        parallel_streams<decltype(first)::iterator, collatz_step>;
+    std::vector<std::unique_ptr<Processor>> processors;
+    for (int i = 0; i < length - 1; ++i)
+        processors.push_back(std::make_unique<Processor>(
+            i == 0 ? first.begin() : processors.back()->begin(),
+            i == 0 ? first.end() : processors.back()->end(), collatz_step{}, 1));
+    int sum = 0;
+    for (int item : *processors.back())
+        sum += item;
+    return {seconds_since(start), {{"checksum", double(sum)}}};
+}
+
+// The same stages sharing a thread_pool
+sample deep_pipeline_pool(const std::vector<int> &input, int length,
+                          std::size_t threadCount) {
+    auto start = benchmark_clock::now();
+    thread_pool threads(threadCount);
+    stream_options options;
+    options.capacity = 64;
+    parallel_streams first(input.begin(), input.end(), collatz_step{}, threads,
+                           options);
+    using Processor =
+        parallel_streams<decltype(first)::iterator, collatz_step>;
+    std::vector<std::unique_ptr<Processor>> processors;
+    for (int i = 0; i < length - 1; ++i)
+        processors.push_back(std::make_unique<Processor>(
+            i == 0 ? first.begin() : processors.back()->begin(),
+            i == 0 ? first.end() : processors.back()->end(), collatz_step{},
+            threads, options));
+    int sum = 0;
+    for (int item : *processors.back())
+        sum += item;
+    return {seconds_since(start), {{"checksum", double(sum)}}};
+}
+
+// Summing a stage's output on the consuming thread
+sample reduce_consumer(const std::vector<int> &input, std::size_t threadCount,
+                       int cost) {
+    auto start = benchmark_clock::now();
+    parallel_streams runner(
+        input.begin(), input.end(), [cost](int i) { return spin(i, cost); },
+        threadCount);
+    long long sum = 0;
+    for (int item : runner)
+        sum += item;
+    return {seconds_since(start), {{"checksum", double(sum & 0xffff)}}};
+}
+
+// The same sum with per-thread accumulators and no output queue
+sample reduce_parallel(const std::vector<int> &input, std::size_t threadCount,
+                       int cost) {
+    auto start = benchmark_clock::now();
+    long long sum = fold(
+        input.begin(), input.end(), 0LL,
+        [cost](long long total, int i) { return total + spin(i, cost); },
+        [](long long a, long long b) { return a + b; }, threadCount);
+    return {seconds_since(start), {{"checksum", double(sum & 0xffff)}}};
+}
+
+template <int Count, class Pipeline>
+auto map_repeat(const Pipeline &p) {
+    if constexpr (Count == 0)
+        return p;
+    else
+        return map_repeat<Count - 1>(p | map(collatz_step{}));
+}
+
+// The same steps fused into a single stage with pipeline.hpp
+sample deep_pipeline_fused(const std::vector<int> &input,
+                           std::size_t threadCount) {
+    auto start = benchmark_clock::now();
+    int sum = 0;
+    map_repeat<178>(source(input)) | parallel(threadCount) |
+        for_each([&](int item) { sum += item; });
+    return {seconds_since(start), {{"checksum", double(sum)}}};
+}
+
+template <class Buffer>
+void queue_benchmarks(benchmark_suite &suite, const std::string &buffer,
+                      const std::vector<std::pair<int, int>> &counts) {
+    std::size_t items = suite.scale(1000000);
+    for (auto [producers, consumers] : counts)
+        suite.run("queue_throughput",
+                  {{"buffer", buffer},
+                   {"producers", std::to_string(producers)},
+                   {"consumers", std::to_string(consumers)}},
+                  items, [&, producers = producers, consumers = consumers] {
+                      return queue_throughput<Buffer>(items, producers,
+                                                      consumers);
+                  });
+    std::size_t trips = suite.scale(20000);
+    suite.run("queue_latency", {{"buffer", buffer}}, trips,
+              [&] { return queue_latency<Buffer>(trips); });
+}
+
+std::vector<std::size_t> thread_counts() {
+    std::vector<std::size_t> result{1, 2, 4};
+    std::size_t hw = std::max(std::thread::hardware_concurrency(), 1u);
+    if (hw > 4)
+        result.push_back(hw);
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    settings s;
+    const char *outPath = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc)
+            s.filter = argv[++i];
+        else if (arg == "--repetitions" && i + 1 < argc)
+            s.repetitions = std::max(1, atoi(argv[++i]));
+        else if (arg == "--quick")
+            s.quick = true;
+        else if (arg == "--out" && i + 1 < argc)
+            outPath = argv[++i];
+        else {
+            fprintf(stderr,
+                    "Usage: %s [--filter <substring>] [--repetitions <n>] "
+                    "[--quick] [--out <file>]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    benchmark_suite suite(s);
+    std::vector<std::pair<int, int>> manyToMany{
+        {1, 1}, {2, 1}, {1, 2}, {2, 2}, {4, 4}};
+    queue_benchmarks<locked_buffer<int>>(suite, "locked_buffer", manyToMany);
+    queue_benchmarks<mpmc_ring_buffer<int>>(suite, "mpmc_ring_buffer",
+                                            manyToMany);
+    queue_benchmarks<mpsc_ring_buffer<int>>(suite, "mpsc_ring_buffer",
+                                            {{1, 1}, {4, 1}});
+    queue_benchmarks<spsc_ring_buffer<int>>(suite, "spsc_ring_buffer",
+                                            {{1, 1}});
+
+    std::size_t calls = suite.scale(1000000);
+    for (std::size_t threads : thread_counts())
+        for (std::size_t tasks : {1, 16})
+            suite.run("pool_dispatch",
+                      {{"threads", std::to_string(threads)},
+                       {"tasks", std::to_string(tasks)}},
+                      calls,
+                      [&] { return pool_dispatch(calls, threads, tasks); });
+
+    std::vector<int> input(suite.scale(100000));
+    for (std::size_t i = 0; i < input.size(); ++i)
+        input[i] = int(i);
+    for (int cost : {0, 100, 1000})
+        for (std::size_t threads : thread_counts())
+            suite.run("parallel_streams_scaling",
+                      {{"threads", std::to_string(threads)},
+                       {"cost", std::to_string(cost)}},
+                      input.size(), [&] {
+                          return parallel_streams_scaling(input, threads,
+                                                          cost);
+                      });
+
+    for (int cost : {0, 100})
+        for (std::size_t threads : thread_counts()) {
+            suite.run("reduce",
+                      {{"mode", "consumer"},
+                       {"threads", std::to_string(threads)},
+                       {"cost", std::to_string(cost)}},
+                      input.size(),
+                      [&] { return reduce_consumer(input, threads, cost); });
+            suite.run("reduce",
+                      {{"mode", "parallel_reduce"},
+                       {"threads", std::to_string(threads)},
+                       {"cost", std::to_string(cost)}},
+                      input.size(),
+                      [&] { return reduce_parallel(input, threads, cost); });
+        }
+
+    for (std::size_t threads : thread_counts()) {
+        const int steps = 178;
+        suite.run("collatz",
+                  {{"mode", "items"}, {"threads", std::to_string(threads)}},
+                  input.size(),
+                  [&] { return collatz_items(input, threads, steps); });
+        suite.run("collatz",
+                  {{"mode", "batch_map"}, {"threads", std::to_string(threads)}},
+                  input.size(),
+                  [&] { return collatz_batches(input, threads, steps); });
+    }
+
+    // Collatz stopping times below 1000 are at most 178 steps
+    std::vector<int> numbers;
+    for (int i = 1; i < 1000; ++i)
+        numbers.push_back(i);
+    const int length = 178;
+    suite.run("deep_pipeline",
+              {{"stages", std::to_string(length)}, {"mode", "threads"}},
+              numbers.size(),
+              [&] { return deep_pipeline_threads(numbers, length); });
+    for (std::size_t threads : thread_counts())
+        suite.run("deep_pipeline",
+                  {{"stages", std::to_string(length)},
+                   {"mode", "thread_pool"},
+                   {"threads", std::to_string(threads)}},
+                  numbers.size(),
+                  [&] { return deep_pipeline_pool(numbers, length, threads); });
+    for (std::size_t threads : thread_counts())
+        suite.run("deep_pipeline",
+                  {{"stages", std::to_string(length)},
+                   {"mode", "fused"},
+                   {"threads", std::to_string(threads)}},
+                  numbers.size(),
+                  [&] { return deep_pipeline_fused(numbers, threads); });
+
+    FILE *out = outPath ? fopen(outPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", outPath);
+        return 1;
+    }
+    suite.write_json(out);
+    if (outPath)
+        fclose(out);
+    return 0;
+}
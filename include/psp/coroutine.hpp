@@ -0,0 +1,210 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+// Opt-in C++20 front-end. The rest of the library only needs C++17.
+#if !defined(__cpp_impl_coroutine)
+#error "psp/coroutine.hpp requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "stream_queue.hpp"
+#include "thread_pool.hpp"
+
+namespace psp {
+
+namespace detail {
+
+// Something a coroutine_stage is suspended on. The thread_pool task running
+// the stage polls it rather than resuming the coroutine blindly, and if it is
+// not ready, asks it to call the task's waker when it might be.
+class stage_awaiter {
+public:
+    // Tries the operation without waiting. True if the coroutine can resume.
+    virtual bool poll() = 0;
+
+    // Registers the waker. Returns false if the operation may already
+    // succeed, in which case it is polled again rather than waited for.
+    virtual bool wait(thread_pool::waker waker) = 0;
+
+protected:
+    ~stage_awaiter() = default;
+};
+
+} // namespace detail
+
+/**
+ * @brief Coroutine that runs as a thread_pool task
+ *
+ * A stage is a coroutine returning coroutine_stage that reads and writes
+ * stream_queues with co_await async_pop() and co_await async_push(). Where a
+ * blocking pop() or push() would put the thread to sleep, the stage suspends
+ * and its thread moves on to other tasks until the queue wakes it. This makes
+ * it cheap to run many more stages, e.g. one pipeline per request, than there
+ * are threads.
+ *
+ * The coroutine starts suspended and does nothing until passed to spawn().
+ * It is only ever resumed by one thread at a time and is destroyed, along
+ * with its arguments such as queue writers, once it finishes.
+ *
+ * Example:
+ * @code
+ * coroutine_stage square(stream_queue<int> &input,
+ *                        stream_queue<int>::writer output) {
+ *     while (std::optional<int> item = co_await async_pop(input))
+ *         co_await async_push(output, *item * *item);
+ * }
+ * stream_queue<int> input, output;
+ * thread_pool threads;
+ * spawn(threads, square(input, output.make_writer()));
+ * @endcode
+ */
+class coroutine_stage {
+public:
+    struct promise_type {
+        coroutine_stage get_return_object() {
+            return coroutine_stage(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+
+        // There is nobody to rethrow to on a pool thread
+        void unhandled_exception() { std::terminate(); }
+
+        // Set by the awaiter the coroutine is suspended on, if any
+        detail::stage_awaiter *awaiting{nullptr};
+    };
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    coroutine_stage(coroutine_stage &&other)
+        : m_handle(std::exchange(other.m_handle, {})) {}
+    coroutine_stage &operator=(coroutine_stage &&other) {
+        std::swap(m_handle, other.m_handle);
+        return *this;
+    }
+    coroutine_stage(const coroutine_stage &other) = delete;
+    coroutine_stage &operator=(const coroutine_stage &other) = delete;
+    ~coroutine_stage() {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    bool done() const { return !m_handle || m_handle.done(); }
+
+    // Runs the coroutine until it finishes or suspends. Intended to be
+    // called repeatedly by a single thread_pool task. Resumes at most once
+    // per call so one stage cannot hog a thread.
+    task_status resume() {
+        promise_type &promise = m_handle.promise();
+        if (!promise.awaiting || promise.awaiting->poll()) {
+            promise.awaiting = nullptr;
+            m_handle.resume();
+            if (m_handle.done())
+                return task_status::finished;
+            if (!promise.awaiting)
+                return task_status::ready;
+        }
+
+        // Suspended on a queue that was just polled. Sleep until it wakes us.
+        if (promise.awaiting->wait(thread_pool::current_waker()))
+            return task_status::waiting;
+        return task_status::ready;
+    }
+
+private:
+    explicit coroutine_stage(handle_type handle) : m_handle(handle) {}
+    handle_type m_handle;
+};
+
+// Schedules a coroutine_stage on the thread pool. It only ever takes one
+// thread at a time.
+inline void spawn(thread_pool &threads, coroutine_stage stage) {
+    threads.process(
+        [stage = std::move(stage)]() mutable { return stage.resume(); }, 1);
+}
+
+namespace detail {
+
+// Common awaitable interface. Completes without suspending if Derived::poll()
+// succeeds straight away.
+template <class Derived> class stage_awaitable : public stage_awaiter {
+public:
+    bool await_ready() { return static_cast<Derived *>(this)->poll(); }
+    void await_suspend(coroutine_stage::handle_type handle) {
+        handle.promise().awaiting = this;
+    }
+
+protected:
+    ~stage_awaitable() = default;
+};
+
+template <class Queue>
+class pop_awaitable final
+    : public stage_awaitable<pop_awaitable<Queue>> {
+public:
+    using value_type = typename Queue::value_type;
+    explicit pop_awaitable(Queue &queue) : m_queue(queue) {}
+    bool poll() override {
+        m_value = m_queue.try_pop();
+        return m_value || m_queue.finished();
+    }
+    bool wait(thread_pool::waker waker) override {
+        return m_queue.notify_when_ready(std::move(waker));
+    }
+    std::optional<value_type> await_resume() { return std::move(m_value); }
+
+private:
+    Queue &m_queue;
+    std::optional<value_type> m_value;
+};
+
+template <class Writer, class T>
+class push_awaitable final
+    : public stage_awaitable<push_awaitable<Writer, T>> {
+public:
+    push_awaitable(Writer &writer, T &&value)
+        : m_writer(writer), m_value(std::move(value)) {}
+
+    // try_push() leaves the value untouched when the queue is full
+    bool poll() override { return m_writer.try_push(std::move(m_value)); }
+    bool wait(thread_pool::waker waker) override {
+        return m_writer.notify_when_space(std::move(waker));
+    }
+    void await_resume() {}
+
+private:
+    Writer &m_writer;
+    T m_value;
+};
+
+} // namespace detail
+
+// Awaitable version of stream_queue::pop(). Resumes with an empty
+// std::optional at the end of the stream. Only valid in a coroutine_stage.
+template <class T, class Buffer>
+detail::pop_awaitable<stream_queue<T, Buffer>>
+async_pop(stream_queue<T, Buffer> &queue) {
+    return detail::pop_awaitable<stream_queue<T, Buffer>>(queue);
+}
+
+// Awaitable version of stream_queue::writer::push(). Only valid in a
+// coroutine_stage.
+template <class Writer, class V>
+detail::push_awaitable<Writer, typename Writer::value_type>
+async_push(Writer &writer, V &&value) {
+    return {writer, typename Writer::value_type(std::forward<V>(value))};
+}
+
+} // namespace psp
@@ -0,0 +1,269 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "indexed_processing.hpp"
+#include "stream_queue.hpp"
+
+namespace psp {
+
+// Default file_sink serializer. Writes strings and numbers, one per line.
+struct line_serializer {
+    template <class T> void operator()(const T &item, std::string &out) const {
+        if constexpr (std::is_convertible_v<const T &, std::string_view>)
+            out.append(std::string_view(item));
+        else
+            out.append(std::to_string(item));
+        out.push_back('\n');
+    }
+};
+
+// Optional settings for file_sink
+struct file_sink_options {
+    // Bytes serialized into a block before it is handed to the writer
+    // thread. Larger blocks mean fewer, larger writes.
+    std::size_t flush_bytes{1 << 20};
+
+    // Write items in index order, as given to writer::push(index, item).
+    // Indices must start at zero with no gaps or repeats. Items that arrive
+    // early are held in memory until everything before them is written.
+    bool ordered{false};
+
+    // In ordered mode, how far past the next index to write items may be
+    // pushed. Pushing an item further ahead blocks until the file catches
+    // up, which bounds the items held in memory.
+    std::size_t reorder_window{1024};
+
+    // Maximum number of items waiting to be serialized before writers
+    // block. Zero means unbounded.
+    std::size_t capacity{0};
+};
+
+/**
+ * @brief Terminal stage that writes items to a file in the background
+ *
+ * Items pushed through a writer() are serialized by a dedicated thread into
+ * blocks of file_sink_options::flush_bytes, which a second thread writes to
+ * the file. While one block is being written, the next is being filled, so
+ * neither the threads pushing items nor serialization wait for the disk.
+ * Serialize is called as serialize(item, std::string &block) and should
+ * append the item's bytes.
+ *
+ * Stage functions may push directly from their worker threads, so results
+ * never pass through an output queue and a consumer loop. close(), or the
+ * destructor, waits for the last writer to be released, then writes
+ * everything and closes the file.
+ *
+ * Example:
+ * @code
+ * file_sink<int> sink("squares.txt");
+ * {
+ *     auto writer = sink.make_writer();
+ *     for (int i = 0; i < 10; ++i)
+ *         writer.push(i * i);
+ * }
+ * sink.close();
+ * @endcode
+ */
+template <class T, class Serialize = line_serializer> class file_sink {
+    using item_type = std::pair<std::size_t, T>;
+    using item_queue = stream_queue<item_type>;
+
+public:
+    // Feeds the sink. The file is finished once every writer is released.
+    class writer {
+    public:
+        template <class V> void push(V &&value) {
+            m_writer.push(item_type(0, std::forward<V>(value)));
+        }
+
+        // In ordered mode, gives the item's position in the file. Waits
+        // while the index is outside the reorder window. Throws
+        // std::out_of_range if the index was already written.
+        template <class V> void push(std::size_t index, V &&value) {
+            if (m_reorder) {
+                if (index < m_reorder->released())
+                    throw std::out_of_range("file_sink index " +
+                                            std::to_string(index) +
+                                            " was already written");
+                if (!m_reorder->in_window(index))
+                    m_reorder->wait_for_window(index);
+            }
+            m_writer.push(item_type(index, std::forward<V>(value)));
+        }
+
+    private:
+        friend class file_sink;
+        writer(typename item_queue::writer &&w, reorder_buffer<T> *reorder)
+            : m_writer(std::move(w)), m_reorder(reorder) {}
+        typename item_queue::writer m_writer;
+        reorder_buffer<T> *m_reorder;
+    };
+
+    // Opens path for writing, truncating it. Throws std::system_error if it
+    // cannot be opened.
+    explicit file_sink(const std::string &path, Serialize serialize = {},
+                       const file_sink_options &options = {})
+        : m_serialize(std::move(serialize)),
+          m_flushBytes(std::max<std::size_t>(options.flush_bytes, 1)),
+          m_items(options.capacity), m_blocks(1) {
+        if (options.ordered)
+            m_reorder.emplace(options.reorder_window);
+        m_file = std::fopen(path.c_str(), "wb");
+        if (!m_file)
+            throw std::system_error(errno, std::generic_category(),
+                                    "opening " + path);
+
+        // Blocks are written whole, so the FILE's own buffer is a copy
+        std::setvbuf(m_file, nullptr, _IONBF, 0);
+
+        // Held until close() so the serializer cannot finish before any
+        // writers are made
+        m_ownWriter.emplace(m_items.make_writer());
+        m_serializeThread = std::thread(&file_sink::serialize_all, this,
+                                        m_blocks.make_writer());
+        m_writeThread = std::thread(&file_sink::write_all, this,
+                                    m_free.make_writer());
+    }
+
+    ~file_sink() {
+        try {
+            close();
+        } catch (const std::system_error &) {
+            // Call close() first to see write errors
+        }
+    }
+    file_sink(const file_sink &other) = delete;
+    file_sink &operator=(const file_sink &other) = delete;
+
+    writer make_writer() {
+        return writer(m_items.make_writer(),
+                      m_reorder ? &*m_reorder : nullptr);
+    }
+
+    // Waits for all writers to be released and everything to be written,
+    // then closes the file. Throws std::system_error if a write failed, or
+    // with EINVAL in ordered mode if an index was never pushed, in which
+    // case the items after it are not written.
+    void close() {
+        std::lock_guard<std::mutex> lk(m_closeMutex);
+        if (!m_file)
+            return;
+        m_ownWriter.reset();
+        m_serializeThread.join();
+        m_writeThread.join();
+        errno = 0;
+        if (std::fclose(m_file) != 0 && !m_error)
+            m_error = errno ? errno : EIO;
+        m_file = nullptr;
+        if (m_error)
+            throw std::system_error(m_error, std::generic_category(),
+                                    "writing file_sink");
+        if (m_missing)
+            throw std::system_error(EINVAL, std::generic_category(),
+                                    "file_sink index " +
+                                        std::to_string(*m_missing) +
+                                        " was never written");
+    }
+
+private:
+    // Serializer thread. Pops items in batches and hands full blocks to the
+    // writer thread.
+    void serialize_all(typename stream_queue<std::string>::writer blocks) {
+        std::string block = take_block();
+        auto append = [&](T &item) {
+            m_serialize(item, block);
+            if (block.size() >= m_flushBytes) {
+                blocks.push(std::move(block));
+                block = take_block();
+            }
+        };
+        std::vector<T> released;
+        for (auto &item : m_items.drain(256)) {
+            if (!m_reorder) {
+                append(item.second);
+                continue;
+            }
+            released.clear();
+            released.push_back(std::move(item.second));
+            m_reorder->insert(item.first, released, [&](std::vector<T> &run) {
+                for (auto &value : run)
+                    append(value);
+            });
+        }
+        if (!block.empty())
+            blocks.push(std::move(block));
+        if (m_reorder && !m_reorder->empty())
+            m_missing = m_reorder->released();
+    }
+
+    // Writer thread. Returns written blocks to the serializer for reuse.
+    void write_all(typename stream_queue<std::string>::writer free) {
+        while (std::optional<std::string> block = m_blocks.pop()) {
+            // fwrite() need not set errno, so clear any left from earlier
+            errno = 0;
+            if (!m_error &&
+                std::fwrite(block->data(), 1, block->size(), m_file) !=
+                    block->size())
+                m_error = errno ? errno : EIO;
+            block->clear();
+            free.try_push(std::move(*block));
+        }
+    }
+
+    std::string take_block() {
+        std::optional<std::string> block = m_free.try_pop();
+        if (block)
+            return std::move(*block);
+        std::string result;
+        result.reserve(m_flushBytes + m_flushBytes / 4);
+        return result;
+    }
+
+    Serialize m_serialize;
+    const std::size_t m_flushBytes;
+    std::optional<reorder_buffer<T>> m_reorder;
+    std::FILE *m_file{nullptr};
+
+    // Only set by the writer thread, and read after it is joined
+    int m_error{0};
+
+    // Ordered mode only. Set by the serializer thread if items were left
+    // waiting for this index, and read after it is joined.
+    std::optional<std::size_t> m_missing;
+
+    item_queue m_items;
+    std::optional<typename item_queue::writer> m_ownWriter;
+
+    // Full blocks, bounded to one waiting while another is written, and
+    // empty ones to reuse
+    stream_queue<std::string> m_blocks;
+    stream_queue<std::string> m_free;
+
+    std::mutex m_closeMutex;
+    std::thread m_serializeThread;
+    std::thread m_writeThread;
+};
+
+} // namespace psp
@@ -13,6 +13,10 @@
 
 #pragma once
 
+#include <functional>
+#include <tuple>
+#include <utility>
+
 namespace psp {
 
 template <class F> struct function_traits;
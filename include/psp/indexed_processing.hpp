@@ -8,8 +8,18 @@
 #pragma once
 
 #include "function_traits.hpp"
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace psp {
 
@@ -21,7 +31,7 @@ public:
 
     template <class ValueFwd>
     indexed_value(size_type index, size_type step, ValueFwd &&value)
-        : index(index), step(step), value(value) {}
+        : index(index), step(step), value(std::forward<ValueFwd>(value)) {}
 
     size_type index;
     size_type step;
@@ -104,4 +114,124 @@ private:
   Func m_func;
 };
 
+/**
+ * @brief Releases values in index order when they are inserted out of order
+ *
+ * Values wait until every lower index has been inserted. Producers should only
+ * start on indices inside the window, i.e. less than window past the next
+ * index to be released, which bounds the memory held and how far a slow item
+ * can hold back the rest.
+ */
+template <class Value> class reorder_buffer {
+public:
+    using size_type = std::size_t;
+
+    explicit reorder_buffer(size_type window) : m_window(window ? window : 1) {}
+
+    size_type window() const { return m_window; }
+
+    bool in_window(size_type index) const {
+        return index < m_next.load() + m_window;
+    }
+
+    // The number of values released so far, i.e. the next index to release
+    size_type released() const { return m_next.load(); }
+
+    // True if no values are waiting for a lower index or to be released
+    bool empty() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_pending.empty() && m_ready.empty();
+    }
+
+    void wait_for_window(size_type index) {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_cond.wait(lk, [&] { return in_window(index); });
+    }
+
+    // Inserts values for consecutive indices starting at index, then calls
+    // release(values) with runs of values that are now in order, if any. The
+    // values vector is reused to hold each run and is left empty. Only one
+    // thread releases at a time, so runs stay in order, and it does so
+    // without holding the lock, as release() may block on a full output.
+    // Runs that become ready meanwhile are released by that thread, leaving
+    // the others free to continue. The window only moves once a run has been
+    // released, so the runs waiting are bounded by it too.
+    template <class Release>
+    void insert(size_type index, std::vector<Value> &values,
+                Release &&release) {
+        std::unique_lock<std::mutex> lk(m_mutex);
+
+        // Each index must be inserted exactly once. Drop indices that were
+        // already released rather than wrapping the offset.
+        assert(index >= m_taken);
+        if (index < m_taken) {
+            values.clear();
+            return;
+        }
+        size_type offset = index - m_taken;
+        if (m_pending.size() < offset + values.size())
+            m_pending.resize(offset + values.size());
+        for (size_type i = 0; i < values.size(); ++i) {
+            assert(!m_pending[offset + i].has_value());
+            m_pending[offset + i] = std::move(values[i]);
+        }
+        values.clear();
+        while (!m_pending.empty() && m_pending.front().has_value()) {
+            m_ready.push_back(std::move(*m_pending.front()));
+            m_pending.pop_front();
+            ++m_taken;
+        }
+        if (m_releasing)
+            return;
+        m_releasing = true;
+        while (!m_ready.empty()) {
+            std::swap(values, m_ready);
+            lk.unlock();
+            release(values);
+            size_type released = values.size();
+            values.clear();
+            lk.lock();
+            m_next += released;
+            m_cond.notify_all();
+            std::vector<std::function<void()>> callbacks;
+            std::swap(callbacks, m_windowCallbacks);
+            if (!callbacks.empty()) {
+                lk.unlock();
+                for (auto &callback : callbacks)
+                    callback();
+                lk.lock();
+            }
+        }
+        m_releasing = false;
+    }
+
+    // Calls callback once, when the window next moves, e.g. to wake a
+    // thread_pool task waiting to claim index. Returns false without
+    // registering if index is already inside the window.
+    bool notify_when_in_window(size_type index,
+                               std::function<void()> callback) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (in_window(index))
+            return false;
+        m_windowCallbacks.push_back(std::move(callback));
+        return true;
+    }
+
+private:
+    const size_type m_window;
+
+    // Values released, which is where the window starts
+    std::atomic<size_type> m_next{0};
+
+    // Guarded by m_mutex. Values taken from m_pending, which may still be
+    // waiting in m_ready to be released.
+    size_type m_taken{0};
+    std::deque<std::optional<Value>> m_pending;
+    std::vector<Value> m_ready;
+    bool m_releasing{false};
+    std::vector<std::function<void()>> m_windowCallbacks;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
+
 } // namespace psp
@@ -0,0 +1,390 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace psp {
+
+/**
+ * @brief Read-only memory mapping of a whole file
+ *
+ * The contents are paged in by the OS as they are touched, so nothing is
+ * read up front and the memory is shared with the page cache. Throws
+ * std::system_error if the file cannot be opened or mapped.
+ */
+class mapped_file {
+public:
+    explicit mapped_file(const std::string &path) {
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                  nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw_last_error("opening " + path);
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) {
+            int error = last_error();
+            CloseHandle(file);
+            throw_last_error(error, "reading the size of " + path);
+        }
+        m_size = static_cast<std::size_t>(size.QuadPart);
+        if (m_size) {
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY,
+                                                0, 0, nullptr);
+            if (mapping)
+                m_data = static_cast<const char *>(
+                    MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            int error = m_data ? 0 : last_error();
+            if (mapping)
+                CloseHandle(mapping);
+            if (!m_data) {
+                CloseHandle(file);
+                throw_last_error(error, "mapping " + path);
+            }
+        }
+        CloseHandle(file);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw_last_error("opening " + path);
+        struct stat info;
+        if (::fstat(fd, &info) == -1) {
+            int error = last_error();
+            ::close(fd);
+            throw_last_error(error, "reading the size of " + path);
+        }
+        m_size = static_cast<std::size_t>(info.st_size);
+
+        // mmap() rejects empty mappings
+        if (m_size) {
+            void *data =
+                ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                int error = last_error();
+                ::close(fd);
+                throw_last_error(error, "mapping " + path);
+            }
+            m_data = static_cast<const char *>(data);
+        }
+        ::close(fd);
+#endif
+    }
+    ~mapped_file() { unmap(); }
+
+    mapped_file(mapped_file &&other)
+        : m_data(std::exchange(other.m_data, nullptr)),
+          m_size(std::exchange(other.m_size, 0)) {}
+    mapped_file &operator=(mapped_file &&other) {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+    mapped_file(const mapped_file &other) = delete;
+    mapped_file &operator=(const mapped_file &other) = delete;
+
+    std::string_view data() const { return {m_data, m_size}; }
+    std::size_t size() const { return m_size; }
+
+private:
+    // errno, or GetLastError() on Windows. Cleaning up after a failure can
+    // overwrite it, so read it first.
+    static int last_error() {
+#if defined(_WIN32)
+        return static_cast<int>(GetLastError());
+#else
+        return errno;
+#endif
+    }
+
+    [[noreturn]] static void throw_last_error(const std::string &what) {
+        throw_last_error(last_error(), what);
+    }
+
+    [[noreturn]] static void throw_last_error(int error,
+                                              const std::string &what) {
+#if defined(_WIN32)
+        throw std::system_error(error, std::system_category(), what);
+#else
+        throw std::system_error(error, std::generic_category(), what);
+#endif
+    }
+
+    void unmap() {
+        if (!m_data)
+            return;
+#if defined(_WIN32)
+        UnmapViewOfFile(m_data);
+#else
+        ::munmap(const_cast<char *>(m_data), m_size);
+#endif
+        m_data = nullptr;
+    }
+
+    const char *m_data{nullptr};
+    std::size_t m_size{0};
+};
+
+/**
+ * @brief Records within one chunk of a record_file
+ *
+ * Iterates std::string_views into the mapped file, without copying. Records
+ * are either separated by a delimiter, which is not included, or a fixed
+ * number of bytes long, in which case a trailing partial record is shorter.
+ */
+class record_chunk {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = const std::string_view &;
+
+        iterator() = default;
+        iterator(const record_chunk *chunk, std::size_t pos)
+            : m_chunk(chunk), m_pos(pos) {
+            find_end();
+        }
+        reference operator*() const { return m_record; }
+        pointer operator->() const { return &m_record; }
+        iterator &operator++() {
+            m_pos = m_next;
+            find_end();
+            return *this;
+        }
+        iterator operator++(int) {
+            iterator result = *this;
+            ++*this;
+            return result;
+        }
+        bool operator==(const iterator &other) const {
+            return m_pos == other.m_pos;
+        }
+        bool operator!=(const iterator &other) const {
+            return m_pos != other.m_pos;
+        }
+
+    private:
+        void find_end() {
+            std::string_view data = m_chunk->m_data;
+            if (m_pos >= data.size()) {
+                m_pos = data.size();
+                return;
+            }
+            std::size_t end;
+            if (m_chunk->m_recordSize) {
+                end = std::min(m_pos + m_chunk->m_recordSize, data.size());
+                m_next = end;
+            } else {
+                end = data.find(m_chunk->m_delimiter, m_pos);
+                if (end == std::string_view::npos)
+                    end = m_next = data.size();
+                else
+                    m_next = end + 1;
+            }
+            m_record = data.substr(m_pos, end - m_pos);
+        }
+
+        const record_chunk *m_chunk{nullptr};
+        std::size_t m_pos{0};
+        std::size_t m_next{0};
+        std::string_view m_record;
+    };
+
+    record_chunk() = default;
+    record_chunk(std::string_view data, char delimiter, std::size_t recordSize)
+        : m_data(data), m_delimiter(delimiter), m_recordSize(recordSize) {}
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, m_data.size()); }
+
+    // The chunk's bytes, starting and ending on record boundaries
+    std::string_view data() const { return m_data; }
+
+private:
+    std::string_view m_data;
+    char m_delimiter{'\n'};
+    std::size_t m_recordSize{0};
+};
+
+// Bytes per record_chunk unless given
+inline constexpr std::size_t default_record_chunk_bytes = 1 << 20;
+
+/**
+ * @brief Memory mapped file split into chunks of whole records
+ *
+ * A random access range of record_chunks, so parallel_streams threads claim
+ * chunks with an atomic cursor and read their records straight from the
+ * mapping. Chunk boundaries are found independently, by scanning forward
+ * from a multiple of the chunk size to the next delimiter, so nothing reads
+ * the whole file before processing starts. A record longer than a chunk
+ * leaves empty chunks rather than being split. The file must outlive the
+ * chunks and the string_views they produce.
+ *
+ * Example:
+ * @code
+ * record_file lines("input.txt");
+ * parallel_streams lengths(lines.begin(), lines.end(),
+ *     flat_map([](const record_chunk &chunk, emitter<size_t> &emit) {
+ *         for (std::string_view line : chunk)
+ *             emit(line.size());
+ *     }));
+ * @endcode
+ */
+class record_file {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = record_chunk;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = record_chunk;
+
+        iterator() = default;
+        iterator(const record_file *file, std::size_t index)
+            : m_file(file), m_index(index) {}
+
+        record_chunk operator*() const { return m_file->chunk(m_index); }
+        record_chunk operator[](difference_type n) const {
+            return m_file->chunk(m_index + n);
+        }
+        iterator &operator++() {
+            ++m_index;
+            return *this;
+        }
+        iterator operator++(int) { return iterator(m_file, m_index++); }
+        iterator &operator--() {
+            --m_index;
+            return *this;
+        }
+        iterator operator--(int) { return iterator(m_file, m_index--); }
+        iterator &operator+=(difference_type n) {
+            m_index += n;
+            return *this;
+        }
+        iterator &operator-=(difference_type n) {
+            m_index -= n;
+            return *this;
+        }
+        iterator operator+(difference_type n) const {
+            return iterator(m_file, m_index + n);
+        }
+        friend iterator operator+(difference_type n, const iterator &it) {
+            return it + n;
+        }
+        iterator operator-(difference_type n) const {
+            return iterator(m_file, m_index - n);
+        }
+        difference_type operator-(const iterator &other) const {
+            return difference_type(m_index) - difference_type(other.m_index);
+        }
+        bool operator==(const iterator &other) const {
+            return m_index == other.m_index;
+        }
+        bool operator!=(const iterator &other) const {
+            return m_index != other.m_index;
+        }
+        bool operator<(const iterator &other) const {
+            return m_index < other.m_index;
+        }
+        bool operator>(const iterator &other) const { return other < *this; }
+        bool operator<=(const iterator &other) const {
+            return !(other < *this);
+        }
+        bool operator>=(const iterator &other) const {
+            return !(*this < other);
+        }
+
+    private:
+        const record_file *m_file{nullptr};
+        std::size_t m_index{0};
+    };
+
+    // Records separated by delimiter
+    explicit record_file(const std::string &path, char delimiter = '\n',
+                         std::size_t chunkBytes = default_record_chunk_bytes)
+        : m_file(path), m_delimiter(delimiter),
+          m_chunkBytes(std::max<std::size_t>(chunkBytes, 1)) {
+        m_chunkCount = (m_file.size() + m_chunkBytes - 1) / m_chunkBytes;
+    }
+
+    // Records of exactly recordSize bytes. Chunks hold a whole number of
+    // records.
+    static record_file
+    fixed_size(const std::string &path, std::size_t recordSize,
+               std::size_t chunkBytes = default_record_chunk_bytes) {
+        record_file result(path, '\n', chunkBytes);
+        result.m_recordSize = std::max<std::size_t>(recordSize, 1);
+        result.m_chunkBytes =
+            std::max<std::size_t>(chunkBytes / result.m_recordSize, 1) *
+            result.m_recordSize;
+        result.m_chunkCount =
+            (result.m_file.size() + result.m_chunkBytes - 1) /
+            result.m_chunkBytes;
+        return result;
+    }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, m_chunkCount); }
+    std::size_t size() const { return m_chunkCount; }
+
+    record_chunk chunk(std::size_t index) const {
+        std::size_t first = boundary(index);
+        std::size_t last = boundary(index + 1);
+        return record_chunk(m_file.data().substr(first, last - first),
+                            m_delimiter, m_recordSize);
+    }
+
+    std::string_view data() const { return m_file.data(); }
+
+private:
+    // Start of the first record at or after index * m_chunkBytes
+    std::size_t boundary(std::size_t index) const {
+        std::string_view data = m_file.data();
+        std::size_t pos = index * m_chunkBytes;
+        if (index == 0 || pos >= data.size())
+            return std::min(pos, data.size());
+        if (m_recordSize)
+            return pos;
+
+        // A record starts after the delimiter at or after pos - 1
+        std::size_t delimiter = data.find(m_delimiter, pos - 1);
+        return delimiter == std::string_view::npos ? data.size()
+                                                   : delimiter + 1;
+    }
+
+    mapped_file m_file;
+    char m_delimiter;
+    std::size_t m_chunkBytes;
+    std::size_t m_recordSize{0};
+    std::size_t m_chunkCount{0};
+};
+
+} // namespace psp
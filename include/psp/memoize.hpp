@@ -0,0 +1,305 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "function_traits.hpp"
+#include "ring_buffer.hpp"
+#include "stage_functions.hpp"
+
+namespace psp {
+
+// Returned by concurrent_cache::stats(). Unlike stage_stats, these are
+// always counted, as they are updated under the shard locks anyway.
+struct cache_stats {
+    std::uint64_t hits{0};
+    std::uint64_t misses{0};
+
+    // Hits that waited for another thread's computation of the same key
+    std::uint64_t coalesced{0};
+
+    std::uint64_t evictions{0};
+};
+
+/**
+ * @brief Bounded map from keys to values computed on demand
+ *
+ * Keys are hashed to one of several shards, each with its own lock, so
+ * threads looking up different keys rarely contend. When a shard is full, the
+ * CLOCK algorithm evicts an entry that has not been hit since the hand last
+ * passed it, approximating LRU without reordering a list on every hit.
+ *
+ * Concurrent misses on the same key wait for the first to compute the value
+ * rather than all computing it. The value is computed without holding the
+ * shard lock. If the computation throws, every waiter gets the exception and
+ * the key is forgotten so the next lookup tries again. Entries still being
+ * computed are never evicted, so a shard may exceed its capacity by the
+ * number of computations in flight.
+ */
+template <class Key, class Value, class Hash = std::hash<Key>,
+          class KeyEqual = std::equal_to<Key>>
+class concurrent_cache {
+public:
+    using key_type = Key;
+    using value_type = Value;
+
+    // The capacity is split as evenly as possible between the shards, which
+    // hold exactly capacity entries between them. Zero shards selects one per
+    // hardware thread. The shard count is a power of two, and no more than
+    // the capacity.
+    explicit concurrent_cache(std::size_t capacity, Hash hash = {},
+                              KeyEqual equal = {}, std::size_t shards = 0)
+        : m_hash(hash) {
+        capacity = std::max<std::size_t>(capacity, 1);
+        if (!shards)
+            shards = std::max(std::thread::hardware_concurrency(), 1u);
+        shards = std::min(shards, capacity);
+        m_shardBits = 0;
+        while ((std::size_t(1) << m_shardBits) < shards)
+            ++m_shardBits;
+        if ((std::size_t(1) << m_shardBits) > capacity)
+            --m_shardBits;
+        std::size_t count = std::size_t(1) << m_shardBits;
+        m_shards.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+            m_shards.push_back(std::make_unique<shard>(
+                capacity / count + (i < capacity % count), hash, equal));
+    }
+    concurrent_cache(const concurrent_cache &other) = delete;
+    concurrent_cache &operator=(const concurrent_cache &other) = delete;
+
+    // Returns the cached value for key, calling compute() to make it on a
+    // miss
+    template <class Compute> Value get(const Key &key, Compute &&compute) {
+        std::size_t hash = m_hash(key);
+        shard &s = *m_shards[shard_index(hash)];
+        std::promise<Value> promise;
+        std::shared_future<Value> future;
+        bool owner = false;
+        {
+            std::lock_guard<std::mutex> lk(s.mutex);
+            auto it = s.index.find(key);
+            if (it != s.index.end()) {
+                entry &e = s.entries[it->second];
+                e.referenced = true;
+                ++s.stats.hits;
+                if (!e.ready)
+                    ++s.stats.coalesced;
+                future = e.value;
+            } else {
+                ++s.stats.misses;
+                owner = true;
+                future = promise.get_future().share();
+                s.insert(key, future);
+            }
+        }
+        if (!owner)
+            return future.get();
+        try {
+            promise.set_value(compute());
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lk(s.mutex);
+                s.erase(key);
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        {
+            std::lock_guard<std::mutex> lk(s.mutex);
+            auto it = s.index.find(key);
+            if (it != s.index.end())
+                s.entries[it->second].ready = true;
+        }
+        return future.get();
+    }
+
+    // Counters summed over the shards
+    cache_stats stats() const {
+        cache_stats result;
+        for (auto &s : m_shards) {
+            std::lock_guard<std::mutex> lk(s->mutex);
+            result.hits += s->stats.hits;
+            result.misses += s->stats.misses;
+            result.coalesced += s->stats.coalesced;
+            result.evictions += s->stats.evictions;
+        }
+        return result;
+    }
+
+    // Number of cached entries, including those being computed
+    std::size_t size() const {
+        std::size_t result = 0;
+        for (auto &s : m_shards) {
+            std::lock_guard<std::mutex> lk(s->mutex);
+            result += s->index.size();
+        }
+        return result;
+    }
+
+    std::size_t capacity() const {
+        std::size_t result = 0;
+        for (auto &s : m_shards)
+            result += s->capacity;
+        return result;
+    }
+
+private:
+    struct entry {
+        Key key;
+        std::shared_future<Value> value;
+
+        // Set by hits and cleared by the clock hand
+        bool referenced;
+
+        // False while the value is being computed
+        bool ready;
+    };
+
+    struct alignas(cache_line_size) shard {
+        shard(std::size_t capacity, const Hash &hash, const KeyEqual &equal)
+            : capacity(capacity), index(capacity, hash, equal) {
+            entries.reserve(capacity);
+        }
+
+        // Adds a pending entry, evicting one if full
+        void insert(const Key &key, std::shared_future<Value> value) {
+            entry e{key, std::move(value), false, false};
+            std::size_t slot = entries.size();
+            if (entries.size() >= capacity && evict(slot)) {
+                entries[slot] = std::move(e);
+            } else {
+                slot = entries.size();
+                entries.push_back(std::move(e));
+            }
+            index.emplace(key, slot);
+        }
+
+        // Sweeps the clock hand around the entries until one has not been
+        // hit since it last passed. Gives up after two passes if every entry
+        // is still being computed.
+        bool evict(std::size_t &slot) {
+            for (std::size_t i = 0; i < 2 * entries.size(); ++i) {
+                entry &e = entries[hand];
+                std::size_t current = hand;
+                hand = (hand + 1) % entries.size();
+                if (!e.ready)
+                    continue;
+                if (e.referenced) {
+                    e.referenced = false;
+                    continue;
+                }
+                index.erase(e.key);
+                ++stats.evictions;
+                slot = current;
+                return true;
+            }
+            return false;
+        }
+
+        // Removes a failed entry by moving the last one into its slot
+        void erase(const Key &key) {
+            auto it = index.find(key);
+            if (it == index.end())
+                return;
+            std::size_t slot = it->second;
+            index.erase(it);
+            if (slot + 1 != entries.size()) {
+                entries[slot] = std::move(entries.back());
+                index[entries[slot].key] = slot;
+            }
+            entries.pop_back();
+            if (hand >= entries.size())
+                hand = 0;
+        }
+
+        const std::size_t capacity;
+        mutable std::mutex mutex;
+        std::unordered_map<Key, std::size_t, Hash, KeyEqual> index;
+        std::vector<entry> entries;
+        std::size_t hand{0};
+        cache_stats stats;
+    };
+
+    // Uses the top bits of a mixed hash, as the shard's unordered_map uses
+    // the low bits of the same hash
+    std::size_t shard_index(std::size_t hash) const {
+        if (!m_shardBits)
+            return 0;
+        std::uint64_t mixed = std::uint64_t(hash) * 0x9E3779B97F4A7C15ull;
+        return std::size_t(mixed >> (64 - m_shardBits));
+    }
+
+    Hash m_hash;
+    std::size_t m_shardBits;
+    std::vector<std::unique_ptr<shard>> m_shards;
+};
+
+/**
+ * @brief Stage function that caches its results by input
+ *
+ * Wraps a function of one argument whose result depends only on that
+ * argument. Repeated inputs skip the call and copy the cached result, and
+ * inputs being computed on another thread wait for it. Copies of the function
+ * share the cache, so every thread of a stage sees the same entries.
+ *
+ * Example:
+ * @code
+ * auto fetch = memoize([](const std::string &url) { return download(url); },
+ *                      10000);
+ * parallel_streams pages(urls.begin(), urls.end(), fetch);
+ * ...
+ * cache_stats stats = fetch.stats();
+ * @endcode
+ */
+template <class Func, class Hash = std::hash<std::decay_t<
+                          detail::arg_type_t<Func, 0>>>>
+class memoized_function {
+public:
+    using key_type = std::decay_t<detail::arg_type_t<Func, 0>>;
+    using result_type =
+        std::decay_t<typename function_traits<Func>::return_type>;
+    using cache_type = concurrent_cache<key_type, result_type, Hash>;
+
+    memoized_function(Func func, std::size_t capacity, Hash hash = {})
+        : m_func(std::move(func)),
+          m_cache(std::make_shared<cache_type>(capacity, std::move(hash))) {}
+
+    result_type operator()(const key_type &item) {
+        return m_cache->get(item, [&] { return m_func(item); });
+    }
+
+    cache_stats stats() const { return m_cache->stats(); }
+    const cache_type &cache() const { return *m_cache; }
+
+private:
+    Func m_func;
+    std::shared_ptr<cache_type> m_cache;
+};
+
+template <class Func, class Hash = std::hash<std::decay_t<
+                          detail::arg_type_t<Func, 0>>>>
+memoized_function<Func, Hash> memoize(Func func, std::size_t capacity,
+                                      Hash hash = {}) {
+    return memoized_function<Func, Hash>(std::move(func), capacity,
+                                         std::move(hash));
+}
+
+} // namespace psp
@@ -0,0 +1,206 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ring_buffer.hpp"
+
+namespace psp {
+
+// Default object_pool reset. Empties containers and strings, keeping their
+// capacity.
+struct clear_object {
+    template <class T> void operator()(T &value) const {
+        if constexpr (has_clear<T>())
+            value.clear();
+    }
+
+private:
+    template <class T, class = void> struct has_clear : std::false_type {};
+    template <class T>
+    struct has_clear<T, std::void_t<decltype(std::declval<T &>().clear())>>
+        : std::true_type {};
+};
+
+template <class T, class Reset = clear_object> class object_pool;
+
+/**
+ * @brief Object borrowed from an object_pool, returned when destroyed
+ *
+ * Move-only, so an item passed through stream_queues between stages goes
+ * back to the pool wherever it is finally dropped, e.g. by a consuming
+ * iterator moving to the next item.
+ */
+template <class T, class Reset = clear_object> class pooled {
+public:
+    pooled() = default;
+    pooled(T value, object_pool<T, Reset> &pool)
+        : m_value(std::move(value)), m_pool(&pool) {}
+    pooled(pooled &&other)
+        : m_value(std::move(other.m_value)),
+          m_pool(std::exchange(other.m_pool, nullptr)) {}
+    pooled &operator=(pooled &&other) {
+        if (this != &other) {
+            recycle();
+            m_value = std::move(other.m_value);
+            m_pool = std::exchange(other.m_pool, nullptr);
+        }
+        return *this;
+    }
+    pooled(const pooled &other) = delete;
+    pooled &operator=(const pooled &other) = delete;
+    ~pooled() { recycle(); }
+
+    T &operator*() { return m_value; }
+    const T &operator*() const { return m_value; }
+    T *operator->() { return &m_value; }
+    const T *operator->() const { return &m_value; }
+
+    // Keeps the object rather than returning it to the pool
+    T release() {
+        m_pool = nullptr;
+        return std::move(m_value);
+    }
+
+private:
+    void recycle() {
+        if (m_pool)
+            m_pool->recycle(std::move(m_value));
+        m_pool = nullptr;
+    }
+
+    T m_value;
+    object_pool<T, Reset> *m_pool{nullptr};
+};
+
+/**
+ * @brief Recycles objects between the stages that create and consume them
+ *
+ * Heap-heavy items, such as vectors and strings, are typically allocated by
+ * one stage's threads and freed by another's. Instead, a stage function can
+ * return acquire()d objects and whichever thread drops them returns them to
+ * the pool, with their capacity, for the producer to reuse. Once the pool
+ * holds enough objects for everything in flight, nothing is allocated.
+ *
+ * Objects are kept in shards, one per thread where possible, each with its
+ * own lock so threads rarely contend. A thread that finds its shard empty
+ * takes half of another's, which is how objects released by consumers make
+ * their way back to producers. Reset is called on every returned object.
+ * The pool must outlive the pooled objects it gives out.
+ *
+ * Example:
+ * @code
+ * object_pool<std::vector<int>> buffers;
+ * parallel_streams runner(input.begin(), input.end(),
+ *                         [&buffers](int i) {
+ *                             auto buffer = buffers.acquire();
+ *                             buffer->assign(i, i);
+ *                             return buffer;
+ *                         });
+ * for (auto &buffer : runner)
+ *     use(*buffer); // returned to the pool when the iterator moves on
+ * @endcode
+ */
+template <class T, class Reset> class object_pool {
+public:
+    // Keeps at most maxPerShard objects in each shard, dropping the rest
+    explicit object_pool(std::size_t maxPerShard = 256, Reset reset = {})
+        : m_shards(std::max<std::size_t>(std::thread::hardware_concurrency(),
+                                         1)),
+          m_maxPerShard(std::max<std::size_t>(maxPerShard, 1)),
+          m_reset(std::move(reset)) {}
+    object_pool(const object_pool &other) = delete;
+    object_pool &operator=(const object_pool &other) = delete;
+
+    // Returns a recycled object if there is one, otherwise a new one
+    pooled<T, Reset> acquire() { return pooled<T, Reset>(take(), *this); }
+
+    // Like acquire(), but the caller is responsible for recycle()ing it
+    T take() {
+        shard &own = local_shard();
+        {
+            std::lock_guard<std::mutex> lk(own.mutex);
+            if (!own.free.empty())
+                return pop(own);
+        }
+        for (std::size_t i = 1; i < m_shards.size(); ++i) {
+            shard &other = m_shards[(local_index() + i) % m_shards.size()];
+            std::unique_lock<std::mutex> lk(other.mutex, std::try_to_lock);
+            if (!lk || other.free.empty())
+                continue;
+            T result = pop(other);
+
+            // Take half the rest so the next few take()s stay local
+            std::vector<T> stolen;
+            std::size_t count = other.free.size() / 2;
+            stolen.reserve(count);
+            for (std::size_t j = 0; j < count; ++j)
+                stolen.push_back(pop(other));
+            lk.unlock();
+            std::lock_guard<std::mutex> ownLk(own.mutex);
+            for (auto &value : stolen)
+                if (own.free.size() < m_maxPerShard)
+                    own.free.push_back(std::move(value));
+            return result;
+        }
+        m_created.fetch_add(1, std::memory_order_relaxed);
+        return T();
+    }
+
+    // Resets the object and keeps it for another take() or acquire()
+    void recycle(T &&value) {
+        m_reset(value);
+        shard &own = local_shard();
+        std::lock_guard<std::mutex> lk(own.mutex);
+        if (own.free.size() < m_maxPerShard)
+            own.free.push_back(std::move(value));
+    }
+
+    // Number of objects constructed because none were free. Stops growing
+    // once the pool covers everything in flight.
+    std::size_t created() const {
+        return m_created.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(cache_line_size) shard {
+        std::mutex mutex;
+        std::vector<T> free;
+    };
+
+    static T pop(shard &s) {
+        T result = std::move(s.free.back());
+        s.free.pop_back();
+        return result;
+    }
+
+    // Threads are numbered in the order they first use any pool
+    static std::size_t local_index() {
+        static std::atomic<std::size_t> next{0};
+        thread_local std::size_t index = next.fetch_add(1);
+        return index;
+    }
+
+    shard &local_shard() { return m_shards[local_index() % m_shards.size()]; }
+
+    std::vector<shard> m_shards;
+    const std::size_t m_maxPerShard;
+    Reset m_reset;
+    std::atomic<std::size_t> m_created{0};
+};
+
+} // namespace psp
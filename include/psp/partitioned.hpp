@@ -0,0 +1,203 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "stream_processor.hpp"
+#include "stream_queue.hpp"
+
+namespace psp {
+
+// Items the partitioned_streams dispatcher reads before handing them to the
+// lanes
+inline constexpr std::size_t default_dispatch_batch = 256;
+
+/**
+ * @brief Stage that keeps items with the same key in order
+ *
+ * A dispatcher thread reads the input in order and sends each item to one of
+ * lane_count lanes, chosen by hashing key(item). Each lane has its own
+ * stream_queue and a single thread calling its own copy of func, so items with
+ * equal keys are processed, and pushed to the output, in input order while
+ * different keys run in parallel. State in a mutable func, such as per-key
+ * running totals, is only ever touched by its lane's thread and needs no
+ * locking. For the same reason, func must be copyable. To share one
+ * move-only function between the lanes instead, call it through a
+ * std::shared_ptr, and lock any state it has.
+ *
+ * Throughput scales with the number of lanes as long as the keys are spread
+ * evenly. options.capacity bounds each lane's queue as well as the output, so
+ * one full lane holds up the dispatcher and the others. lane_stats() shows how
+ * evenly the work is spread when PSP_ENABLE_STATS is set.
+ *
+ * Example:
+ * @code
+ * partitioned_streams totals(
+ *     events.begin(), events.end(),
+ *     [](const Event &e) { return e.account; },
+ *     [balances = std::unordered_map<int, int>()](const Event &e) mutable {
+ *         return balances[e.account] += e.amount;
+ *     });
+ * @endcode
+ */
+template <class InputIterator, class KeyFunc, class Func,
+          class Hash = std::hash<std::decay_t<std::invoke_result_t<
+              KeyFunc &, const typename InputIterator::value_type &>>>,
+          class OutputBuffer = locked_buffer<stage_output_t<Func>>>
+class partitioned_streams
+    : public stream_queue<stage_output_t<Func>, OutputBuffer> {
+    using queue_type = stream_queue<stage_output_t<Func>, OutputBuffer>;
+    static_assert(std::is_copy_constructible_v<Func>,
+                  "each lane calls its own copy of func, so it must be "
+                  "copyable");
+
+public:
+    using input_value_type = typename InputIterator::value_type;
+    using lane_queue = stream_queue<input_value_type>;
+    using lane_processor =
+        iterable_processor<typename lane_queue::iterator, Func, OutputBuffer>;
+
+    partitioned_streams(
+        InputIterator begin, InputIterator end, KeyFunc key, Func func,
+        size_t lane_count = std::thread::hardware_concurrency(),
+        const stream_options &options = {}, Hash hash = {})
+        : queue_type(options.capacity), m_inputBegin(begin), m_inputEnd(end),
+          m_key(std::move(key)), m_hash(std::move(hash)) {
+        stream_options laneOptions = options;
+        laneOptions.ordered = false;
+        lane_count = std::max<size_t>(lane_count, 1);
+        for (size_t i = 0; i < lane_count; ++i)
+            m_lanes.push_back(std::make_unique<lane>(*this, func, laneOptions));
+
+        // Make every writer before starting any thread, so neither the lanes
+        // nor the output can close early
+        std::vector<typename lane_queue::writer> laneWriters;
+        for (auto &l : m_lanes) {
+            laneWriters.push_back(l->queue.make_writer());
+            l->thread = std::thread(
+                [&processor = l->processor,
+                 writer = this->make_writer()]() mutable {
+                    processor.process_all(std::move(writer));
+                });
+        }
+        m_dispatcher = std::thread(&partitioned_streams::dispatch, this,
+                                   std::move(laneWriters));
+        this->on_cancel([this] { cancel_input(); });
+    }
+
+    // Cancels the stage if reading has started or the output is bounded. See
+    // ~parallel_streams().
+    ~partitioned_streams() {
+        if (this->popped_any() || this->bounded())
+            this->cancel();
+        m_dispatcher.join();
+        for (auto &l : m_lanes)
+            l->thread.join();
+    }
+    partitioned_streams(const partitioned_streams &other) = delete;
+    partitioned_streams &operator=(const partitioned_streams &other) = delete;
+
+    using queue_type::begin;
+    using queue_type::end;
+
+    size_t lane_count() const { return m_lanes.size(); }
+
+    // Each lane's counters so far. All zero unless PSP_ENABLE_STATS is set.
+    std::vector<stage_stats> lane_stats() const {
+        std::vector<stage_stats> result;
+        for (auto &l : m_lanes)
+            result.push_back(l->processor.stats());
+        return result;
+    }
+
+private:
+    struct lane {
+        lane(queue_type &output, const Func &func,
+             const stream_options &options)
+            : queue(options.capacity),
+              processor(queue.begin(), queue.end(), output, func, options) {}
+        lane_queue queue;
+        lane_processor processor;
+        std::thread thread;
+    };
+
+    size_t lane_of(const input_value_type &item) {
+        return m_hash(m_key(item)) % m_lanes.size();
+    }
+
+    // Dispatcher thread. Routes a batch of input at a time so each lane's
+    // share is pushed with one notification. Nothing is held back while
+    // waiting for more input.
+    void dispatch(std::vector<typename lane_queue::writer> writers) {
+        std::vector<std::vector<input_value_type>> routed(m_lanes.size());
+        std::vector<input_value_type> batch;
+        while (!this->cancelled()) {
+            if constexpr (has_pop_n<InputIterator>()) {
+                batch.clear();
+                if (!m_inputBegin.pop_n(std::back_inserter(batch),
+                                        default_dispatch_batch))
+                    break;
+                for (auto &item : batch)
+                    routed[lane_of(item)].push_back(std::move(item));
+            } else {
+                if (m_inputBegin == m_inputEnd)
+                    break;
+                for (size_t n = 0; n < default_dispatch_batch &&
+                                   m_inputBegin != m_inputEnd;
+                     ++n, ++m_inputBegin) {
+                    auto &&item = *m_inputBegin;
+                    auto &dest = routed[lane_of(item)];
+                    if constexpr (std::is_same_v<typename InputIterator::
+                                                     iterator_category,
+                                                 std::input_iterator_tag>)
+                        dest.push_back(std::move(item));
+                    else
+                        dest.push_back(item);
+                }
+            }
+            for (size_t i = 0; i < routed.size(); ++i) {
+                if (routed[i].empty())
+                    continue;
+                writers[i].push_range(
+                    std::make_move_iterator(routed[i].begin()),
+                    std::make_move_iterator(routed[i].end()));
+                routed[i].clear();
+            }
+        }
+        if (this->cancelled())
+            cancel_input();
+        m_inputEnded = true;
+    }
+
+    // See iterable_processor::cancel_input()
+    void cancel_input() {
+        if constexpr (has_pop_n<InputIterator>())
+            if (!m_inputEnded.load())
+                m_inputBegin.cancel();
+    }
+
+    InputIterator m_inputBegin;
+    InputIterator m_inputEnd;
+    KeyFunc m_key;
+    Hash m_hash;
+    std::vector<std::unique_ptr<lane>> m_lanes;
+    std::atomic<bool> m_inputEnded{false};
+    std::thread m_dispatcher;
+};
+
+} // namespace psp
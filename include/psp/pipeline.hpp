@@ -0,0 +1,344 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "function_traits.hpp"
+#include "reduce.hpp"
+#include "stage_functions.hpp"
+#include "stream_processor.hpp"
+#include "thread_pool.hpp"
+
+namespace psp {
+
+namespace detail {
+
+// Calls Second on the result of First, as one function. Has a plain
+// operator() so function_traits can see the argument and return types.
+template <class First, class Second> class fused_function {
+public:
+    using argument_type =
+        std::tuple_element_t<0, typename function_traits<First>::arg_types>;
+    using result_type = typename function_traits<Second>::return_type;
+
+    fused_function(First first, Second second)
+        : m_first(std::move(first)), m_second(std::move(second)) {}
+
+    result_type operator()(argument_type value) {
+        return m_second(m_first(std::forward<argument_type>(value)));
+    }
+
+private:
+    First m_first;
+    Second m_second;
+};
+
+template <class First, class Second>
+auto fuse(First first, Second second) {
+    if constexpr (std::is_same_v<First, unmapped>)
+        return second;
+    else
+        return fused_function<First, Second>(std::move(first),
+                                             std::move(second));
+}
+
+// Applies a filter or flat_map stage after everything mapped before it
+template <class Func, class Stage> auto prefix(Func func, Stage stage) {
+    if constexpr (std::is_same_v<Func, unmapped>)
+        return stage;
+    else
+        return stage.after(std::move(func));
+}
+
+// Calls callback with each of func's results for one item, of which filter
+// and flat_map functions may have any number
+template <class Func, class Item, class Callback>
+void for_each_result(Func &func, Item &&item, Callback &&callback) {
+    if constexpr (stage_traits<Func>::one_to_one) {
+        callback(func(std::forward<Item>(item)));
+    } else {
+        std::vector<stage_output_t<Func>> outputs;
+        func(std::forward<Item>(item), outputs);
+        for (auto &output : outputs)
+            callback(std::move(output));
+    }
+}
+
+// Keeps a pipeline's parallel_streams alive. Stages are destroyed before the
+// stages they read from, so their threads are joined first.
+struct stage_owner {
+    std::shared_ptr<stage_owner> upstream;
+    std::shared_ptr<void> stage;
+};
+
+} // namespace detail
+
+// Pipeline stage that applies func to every item. Adjacent map stages are
+// fused into a single call, so func may be called from several threads at
+// once and should not depend on which items it has seen.
+template <class Func> struct map_stage {
+    Func func;
+};
+
+template <class Func> map_stage<Func> map(Func func) {
+    return {std::move(func)};
+}
+
+// Pipeline boundary. Everything mapped since the previous boundary runs as
+// one parallel_streams stage, either on its own threads or a thread_pool,
+// with a stream_queue to the next stage.
+struct parallel_stage {
+    std::size_t thread_count;
+    thread_pool *threads;
+    stream_options options;
+};
+
+inline parallel_stage
+parallel(std::size_t thread_count = std::thread::hardware_concurrency(),
+         const stream_options &options = {}) {
+    return {thread_count, nullptr, options};
+}
+
+inline parallel_stage parallel(thread_pool &threads,
+                               const stream_options &options = {}) {
+    return {0, &threads, options};
+}
+
+// Pipeline sink that calls func on every item, on the calling thread
+template <class Func> struct for_each_stage {
+    Func func;
+};
+
+template <class Func> for_each_stage<Func> for_each(Func func) {
+    return {std::move(func)};
+}
+
+// Pipeline sink that folds every item into one value in parallel. See
+// parallel_reduce.
+template <class T, class Accumulate, class Combine> struct reduce_stage {
+    T identity;
+    Accumulate accumulate;
+    Combine combine;
+    std::size_t thread_count;
+    thread_pool *threads;
+};
+
+template <class T, class Accumulate, class Combine>
+reduce_stage<T, Accumulate, Combine>
+reduce(T identity, Accumulate accumulate, Combine combine,
+       std::size_t thread_count = std::thread::hardware_concurrency()) {
+    return {std::move(identity), std::move(accumulate), std::move(combine),
+            thread_count, nullptr};
+}
+
+template <class T, class Accumulate, class Combine>
+reduce_stage<T, Accumulate, Combine> reduce(T identity, Accumulate accumulate,
+                                            Combine combine,
+                                            thread_pool &threads) {
+    return {std::move(identity), std::move(accumulate), std::move(combine), 0,
+            &threads};
+}
+
+/**
+ * @brief Composes stages with operator|, only adding queues at parallel()
+ *
+ * Mapped functions are fused at compile time and only run when the pipeline
+ * reaches a parallel() boundary or a sink. This avoids a stream_queue hop
+ * between every pair of cheap functions, as there would be when chaining
+ * parallel_streams directly.
+ *
+ * Example:
+ * @code
+ * std::vector<int> input{1, 2, 3};
+ * auto squares = source(input) | map([](int i) { return i + 1; }) |
+ *                map([](int i) { return i * i; }) | parallel(4);
+ * squares | for_each([](int i) { std::cout << i << std::endl; });
+ * int total = source(input) | map([](int i) { return i * i; }) |
+ *             reduce(0, std::plus<int>(), std::plus<int>());
+ * @endcode
+ */
+template <class Iterator, class Func = detail::unmapped> class pipeline {
+public:
+    using iterator = Iterator;
+
+    pipeline(Iterator begin, Iterator end, Func func = {},
+             std::shared_ptr<detail::stage_owner> stages = {})
+        : m_begin(std::move(begin)), m_end(std::move(end)),
+          m_func(std::move(func)), m_stages(std::move(stages)) {}
+
+    // Iterating requires everything mapped to have been run by parallel()
+    Iterator begin() const {
+        static_assert(std::is_same_v<Func, detail::unmapped>,
+                      "end the pipeline with parallel() or a sink");
+        return m_begin;
+    }
+    Iterator end() const {
+        static_assert(std::is_same_v<Func, detail::unmapped>,
+                      "end the pipeline with parallel() or a sink");
+        return m_end;
+    }
+
+    // Each stage and sink has an overload for temporary pipelines, which
+    // moves the mapped functions rather than copying them, so they may be
+    // move-only. Copies are used otherwise, leaving this pipeline's alone.
+    template <class G> auto operator|(map_stage<G> stage) const & {
+        return mapped(Func(m_func), std::move(stage));
+    }
+    template <class G> auto operator|(map_stage<G> stage) && {
+        return mapped(std::move(m_func), std::move(stage));
+    }
+
+    // Filters and flat_maps run at the next parallel() boundary, along with
+    // anything mapped before them
+    template <class G, class Pre>
+    auto operator|(filter_function<G, Pre> stage) const & {
+        return prefixed(Func(m_func), std::move(stage));
+    }
+    template <class G, class Pre>
+    auto operator|(filter_function<G, Pre> stage) && {
+        return prefixed(std::move(m_func), std::move(stage));
+    }
+    template <class G, class Pre>
+    auto operator|(flat_map_function<G, Pre> stage) const & {
+        return prefixed(Func(m_func), std::move(stage));
+    }
+    template <class G, class Pre>
+    auto operator|(flat_map_function<G, Pre> stage) && {
+        return prefixed(std::move(m_func), std::move(stage));
+    }
+
+    auto operator|(const parallel_stage &stage) const & {
+        return run_parallel(Func(m_func), stage);
+    }
+    auto operator|(const parallel_stage &stage) && {
+        return run_parallel(std::move(m_func), stage);
+    }
+
+    template <class G> void operator|(for_each_stage<G> sink) const & {
+        Func func = m_func;
+        run_for_each(func, sink);
+    }
+    template <class G> void operator|(for_each_stage<G> sink) && {
+        run_for_each(m_func, sink);
+    }
+
+    // Runs anything mapped inside the reduction rather than adding a queue
+    template <class T, class Accumulate, class Combine>
+    T operator|(reduce_stage<T, Accumulate, Combine> sink) const & {
+        return reduced(Func(m_func), sink);
+    }
+    template <class T, class Accumulate, class Combine>
+    T operator|(reduce_stage<T, Accumulate, Combine> sink) && {
+        return reduced(std::move(m_func), sink);
+    }
+
+private:
+    template <class G> auto mapped(Func func, map_stage<G> stage) const {
+        static_assert(stage_traits<Func>::one_to_one,
+                      "add parallel() between filter() or flat_map() and "
+                      "map()");
+        auto fused = detail::fuse(std::move(func), std::move(stage.func));
+        return pipeline<Iterator, decltype(fused)>(m_begin, m_end,
+                                                   std::move(fused), m_stages);
+    }
+
+    template <class Stage> auto prefixed(Func func, Stage stage) const {
+        static_assert(stage_traits<Func>::one_to_one,
+                      "add parallel() between filter() and flat_map() stages");
+        auto prefix = detail::prefix(std::move(func), std::move(stage));
+        return pipeline<Iterator, decltype(prefix)>(
+            m_begin, m_end, std::move(prefix), m_stages);
+    }
+
+    auto run_parallel(Func func, const parallel_stage &stage) const {
+        static_assert(!std::is_same_v<Func, detail::unmapped>,
+                      "map() something before parallel()");
+        using runner_type = parallel_streams<Iterator, Func>;
+        std::unique_ptr<runner_type> runner;
+        if (stage.threads)
+            runner = std::make_unique<runner_type>(
+                m_begin, m_end, std::move(func), *stage.threads,
+                stage.options);
+        else
+            runner = std::make_unique<runner_type>(
+                m_begin, m_end, std::move(func), stage.thread_count,
+                stage.options);
+        auto begin = runner->begin();
+        auto end = runner->end();
+        auto stages = std::make_shared<detail::stage_owner>();
+        stages->upstream = m_stages;
+        stages->stage = std::move(runner);
+        return pipeline<typename runner_type::iterator>(
+            std::move(begin), std::move(end), {}, std::move(stages));
+    }
+
+    template <class G>
+    void run_for_each(Func &func, for_each_stage<G> &sink) const {
+        for (Iterator it = m_begin; it != m_end; ++it) {
+            if constexpr (std::is_same_v<Func, detail::unmapped>)
+                sink.func(*it);
+            else
+                detail::for_each_result(func, *it, sink.func);
+        }
+    }
+
+    template <class T, class Accumulate, class Combine>
+    T reduced(Func func, reduce_stage<T, Accumulate, Combine> &sink) const {
+        if constexpr (std::is_same_v<Func, detail::unmapped>)
+            return run_reduce(std::move(sink.accumulate), sink);
+        else
+            return run_reduce(
+                [func = std::move(func),
+                 accumulate = std::move(sink.accumulate)](
+                    T total, auto &&item) mutable {
+                    detail::for_each_result(
+                        func, std::forward<decltype(item)>(item),
+                        [&](auto &&value) {
+                            total = accumulate(
+                                std::move(total),
+                                std::forward<decltype(value)>(value));
+                        });
+                    return total;
+                },
+                sink);
+    }
+
+    template <class Accumulate, class Sink>
+    auto run_reduce(Accumulate accumulate, Sink &sink) const {
+        if (sink.threads)
+            return fold(m_begin, m_end, std::move(sink.identity),
+                        std::move(accumulate), std::move(sink.combine),
+                        *sink.threads);
+        return fold(m_begin, m_end, std::move(sink.identity),
+                    std::move(accumulate), std::move(sink.combine),
+                    sink.thread_count);
+    }
+
+    Iterator m_begin;
+    Iterator m_end;
+    Func m_func;
+    std::shared_ptr<detail::stage_owner> m_stages;
+};
+
+// Starts a pipeline reading from an iterator range
+template <class Iterator> pipeline<Iterator> source(Iterator begin, Iterator end) {
+    return pipeline<Iterator>(std::move(begin), std::move(end));
+}
+
+// Starts a pipeline reading from a container, which must outlive it
+template <class Container> auto source(Container &container) {
+    return source(std::begin(container), std::end(container));
+}
+
+} // namespace psp
@@ -0,0 +1,289 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ring_buffer.hpp"
+#include "stream_processor.hpp"
+#include "thread_pool.hpp"
+
+namespace psp {
+
+// Items each thread claims at once in parallel_reduce
+inline constexpr std::size_t default_reduce_batch = 256;
+
+/**
+ * @brief Terminal stage that folds its input into a single value in parallel
+ *
+ * Each thread claims batches of input and folds them into its own
+ * accumulator, starting from identity, with accumulate(T, item) -> T. The
+ * accumulators are cache line aligned so threads do not share lines. When the
+ * input ends they are merged with combine(T, T) -> T. Unlike iterating a
+ * parallel_streams and summing on one thread, nothing passes through an
+ * output queue.
+ *
+ * accumulate is called from several threads at once and items are not seen
+ * in order, so combine should be associative and commutative, and identity
+ * must be neutral for it.
+ *
+ * Example:
+ * @code
+ * std::vector<int> input{1, 2, 3};
+ * parallel_reduce sum(input.begin(), input.end(), 0,
+ *                     [](int total, int i) { return total + i; },
+ *                     [](int a, int b) { return a + b; });
+ * sum.get(); // 6
+ * @endcode
+ */
+template <class InputIterator, class T, class Accumulate, class Combine>
+class parallel_reduce {
+public:
+    using input_value_type = typename InputIterator::value_type;
+
+    // Constructor with own dedicated threads
+    parallel_reduce(InputIterator begin, InputIterator end, T identity,
+                    Accumulate accumulate, Combine combine,
+                    size_t thread_count = std::thread::hardware_concurrency(),
+                    size_t batch_size = default_reduce_batch)
+        : parallel_reduce(begin, end, std::move(identity),
+                          std::move(accumulate), std::move(combine),
+                          std::max<size_t>(thread_count, 1), batch_size,
+                          nullptr) {
+        m_threads.reserve(m_slots.size());
+        for (size_t i = 0; i < m_slots.size(); ++i)
+            m_threads.emplace_back([this, i]() {
+                while (accumulate_some(*m_slots[i], true))
+                    ;
+            });
+    }
+
+    // Constructor to use a shared thread pool. Holds an accumulator per pool
+    // thread, taking whichever is free for each batch.
+    parallel_reduce(InputIterator begin, InputIterator end, T identity,
+                    Accumulate accumulate, Combine combine,
+                    thread_pool &threads,
+                    size_t batch_size = default_reduce_batch)
+        : parallel_reduce(begin, end, std::move(identity),
+                          std::move(accumulate), std::move(combine),
+                          std::max<size_t>(threads.size(), 1), batch_size,
+                          nullptr) {
+        // Signals completion when the pool destroys the task, after the last
+        // call has returned
+        std::shared_ptr<done_signal> done(new done_signal{this});
+        threads.process(
+            [this, done]() -> task_status {
+                slot &s = acquire_slot();
+                bool claimed = accumulate_some(s, false);
+                s.busy.store(false, std::memory_order_release);
+                if (claimed)
+                    return task_status::ready;
+                if (m_inputEnded.load())
+                    return task_status::finished;
+                return wait_for_input() ? task_status::waiting
+                                        : task_status::ready;
+            },
+            m_slots.size());
+    }
+
+    ~parallel_reduce() { wait(); }
+    parallel_reduce(const parallel_reduce &other) = delete;
+    parallel_reduce &operator=(const parallel_reduce &other) = delete;
+
+    // Waits for the input to be consumed and returns the combined result
+    const T &get() {
+        wait();
+        if (!m_result) {
+            T result = std::move(m_slots[0]->value);
+            for (size_t i = 1; i < m_slots.size(); ++i)
+                result = m_combine(std::move(result),
+                                   std::move(m_slots[i]->value));
+            m_result.emplace(std::move(result));
+        }
+        return *m_result;
+    }
+
+private:
+    // One thread's accumulator and its scratch space for claimed items
+    struct alignas(cache_line_size) slot {
+        explicit slot(const T &identity) : value(identity) {}
+        T value;
+        std::vector<input_value_type> batch;
+
+        // Pool mode only
+        std::atomic<bool> busy{false};
+    };
+
+    struct done_signal {
+        parallel_reduce *self;
+        ~done_signal() {
+            std::lock_guard<std::mutex> lk(self->m_doneMutex);
+            self->m_done = true;
+            self->m_doneCond.notify_all();
+        }
+    };
+
+    parallel_reduce(InputIterator begin, InputIterator end, T identity,
+                    Accumulate accumulate, Combine combine, size_t slot_count,
+                    size_t batch_size, std::nullptr_t)
+        : m_inputBegin(begin), m_inputEnd(end),
+          m_accumulate(std::move(accumulate)), m_combine(std::move(combine)),
+          m_batchSize(std::max<size_t>(batch_size, 1)) {
+        if constexpr (is_random_access_input<InputIterator>())
+            m_inputSize = static_cast<std::size_t>(end - begin);
+        m_slots.reserve(slot_count);
+        for (size_t i = 0; i < slot_count; ++i)
+            m_slots.push_back(std::make_unique<slot>(identity));
+    }
+
+    void wait() {
+        if (!m_threads.empty()) {
+            for (auto &thread : m_threads)
+                thread.join();
+            m_threads.clear();
+            m_done = true;
+        }
+        std::unique_lock<std::mutex> lk(m_doneMutex);
+        m_doneCond.wait(lk, [this] { return m_done; });
+    }
+
+    // The pool calls at most one handle per accumulator at once, so one is
+    // always free
+    slot &acquire_slot() {
+        for (size_t i = m_nextSlot.fetch_add(1, std::memory_order_relaxed);;
+             ++i) {
+            slot &s = *m_slots[i % m_slots.size()];
+            bool expected = false;
+            if (s.busy.compare_exchange_weak(expected, true,
+                                             std::memory_order_acquire))
+                return s;
+        }
+    }
+
+    // Claims a batch and folds it into the slot. Returns false if nothing
+    // was claimed, either at the end of the input or, without waiting, when
+    // a queue input is empty.
+    bool accumulate_some(slot &s, bool wait) {
+        if constexpr (is_random_access_input<InputIterator>()) {
+            std::size_t first =
+                m_inputCursor.fetch_add(m_batchSize, std::memory_order_relaxed);
+            if (first >= m_inputSize) {
+                m_inputEnded = true;
+                return false;
+            }
+            std::size_t last = std::min(first + m_batchSize, m_inputSize);
+            for (std::size_t i = first; i < last; ++i)
+                s.value = m_accumulate(std::move(s.value), m_inputBegin[i]);
+            return true;
+        } else {
+            s.batch.clear();
+            {
+                std::lock_guard<std::mutex> lk(m_inputMutex);
+                if constexpr (has_pop_n<InputIterator>()) {
+                    if (wait)
+                        m_inputBegin.pop_n(std::back_inserter(s.batch),
+                                           m_batchSize);
+                    else if (!m_inputBegin.try_pop_n(
+                                 std::back_inserter(s.batch), m_batchSize) &&
+                             !m_inputBegin.ended())
+                        return false;
+                } else {
+                    for (; s.batch.size() < m_batchSize &&
+                           m_inputBegin != m_inputEnd;
+                         ++m_inputBegin) {
+                        if constexpr (std::is_same_v<typename InputIterator::
+                                                         iterator_category,
+                                                     std::input_iterator_tag>)
+                            s.batch.push_back(std::move(*m_inputBegin));
+                        else
+                            s.batch.push_back(*m_inputBegin);
+                    }
+                }
+            }
+            if (s.batch.empty()) {
+                m_inputEnded = true;
+                return false;
+            }
+            for (auto &item : s.batch)
+                s.value = m_accumulate(std::move(s.value), std::move(item));
+            return true;
+        }
+    }
+
+    // Asks a queue input to wake the calling thread_pool task when it has
+    // more. Returns false if it cannot, or if the input is already ready.
+    bool wait_for_input() {
+        if constexpr (has_pop_n<InputIterator>()) {
+            auto waker = thread_pool::current_waker();
+            if (!waker)
+                return false;
+            std::lock_guard<std::mutex> lk(m_inputMutex);
+            return m_inputBegin.notify_when_ready(std::move(waker));
+        } else {
+            return false;
+        }
+    }
+
+    InputIterator m_inputBegin;
+    InputIterator m_inputEnd;
+    std::mutex m_inputMutex;
+    Accumulate m_accumulate;
+    Combine m_combine;
+    const std::size_t m_batchSize;
+    std::atomic<bool> m_inputEnded{false};
+
+    // Random access inputs only
+    std::size_t m_inputSize{0};
+    std::atomic<std::size_t> m_inputCursor{0};
+
+    std::vector<std::unique_ptr<slot>> m_slots;
+    std::atomic<size_t> m_nextSlot{0};
+    std::optional<T> m_result;
+
+    // Dedicated threads, or completion of the pool task
+    std::vector<std::thread> m_threads;
+    std::mutex m_doneMutex;
+    std::condition_variable m_doneCond;
+    bool m_done{false};
+};
+
+// Folds [begin, end) on dedicated threads and returns the result. See
+// parallel_reduce.
+template <class InputIterator, class T, class Accumulate, class Combine>
+T fold(InputIterator begin, InputIterator end, T identity,
+       Accumulate accumulate, Combine combine,
+       size_t thread_count = std::thread::hardware_concurrency(),
+       size_t batch_size = default_reduce_batch) {
+    parallel_reduce<InputIterator, T, Accumulate, Combine> reduce(
+        begin, end, std::move(identity), std::move(accumulate),
+        std::move(combine), thread_count, batch_size);
+    return reduce.get();
+}
+
+// Folds [begin, end) on a thread pool, waiting for the result
+template <class InputIterator, class T, class Accumulate, class Combine>
+T fold(InputIterator begin, InputIterator end, T identity,
+       Accumulate accumulate, Combine combine, thread_pool &threads,
+       size_t batch_size = default_reduce_batch) {
+    parallel_reduce<InputIterator, T, Accumulate, Combine> reduce(
+        begin, end, std::move(identity), std::move(accumulate),
+        std::move(combine), threads, batch_size);
+    return reduce.get();
+}
+
+} // namespace psp
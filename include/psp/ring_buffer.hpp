@@ -0,0 +1,295 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+namespace psp {
+
+// Assumed cache line size, used to keep independently written atomics apart.
+// std::hardware_destructive_interference_size is not ABI stable, so don't use
+// it in a header.
+inline constexpr std::size_t cache_line_size = 64;
+
+// Used when a ring buffer is default constructed or given a zero capacity,
+// e.g. as a stream_queue inside a stream_processor.
+inline constexpr std::size_t default_ring_capacity = 1024;
+
+namespace detail {
+
+inline std::size_t ring_capacity(std::size_t value) {
+    if (!value)
+        value = default_ring_capacity;
+    std::size_t result = 2;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+// Uninitialized storage for a single item. The owning ring buffer tracks
+// whether it holds a value.
+template <class T> class ring_slot {
+public:
+    template <class V> void construct(V &&value) {
+        ::new (static_cast<void *>(m_storage)) T(std::forward<V>(value));
+    }
+    T &get() { return *std::launder(reinterpret_cast<T *>(m_storage)); }
+    T take() {
+        T result(std::move(get()));
+        get().~T();
+        return result;
+    }
+
+private:
+    alignas(T) unsigned char m_storage[sizeof(T)];
+};
+
+/**
+ * @brief Bounded ring buffer with a sequence number per cell
+ *
+ * Based on Dmitry Vyukov's bounded MPMC queue. Producers claim a cell with a
+ * CAS on the tail and publish it by bumping the cell's sequence number, so
+ * there is no lock and no shared counter of items. With SingleConsumer the
+ * head is only ever written by one thread and the CAS is skipped.
+ */
+template <class T, bool SingleConsumer> class sequenced_ring_buffer {
+public:
+    using value_type = T;
+
+    explicit sequenced_ring_buffer(
+        std::size_t capacity = default_ring_capacity)
+        : m_mask(ring_capacity(capacity) - 1),
+          m_cells(new cell[m_mask + 1]) {
+        for (std::size_t i = 0; i <= m_mask; ++i)
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    ~sequenced_ring_buffer() {
+        while (try_pop())
+            ;
+    }
+    sequenced_ring_buffer(const sequenced_ring_buffer &other) = delete;
+    sequenced_ring_buffer &
+    operator=(const sequenced_ring_buffer &other) = delete;
+
+    // Returns false without touching value if the buffer is full
+    template <class V> bool try_push(V &&value) {
+        std::size_t pos = m_tail.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &m_cells[pos & m_mask];
+            std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(seq) -
+                        static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        c->slot.construct(std::forward<V>(value));
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <class InputIt> InputIt try_push_range(InputIt first, InputIt last) {
+        while (first != last && try_push(*first))
+            ++first;
+        return first;
+    }
+
+    std::optional<value_type> try_pop() {
+        std::size_t pos = m_head.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &m_cells[pos & m_mask];
+            std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(seq) -
+                        static_cast<std::intptr_t>(pos + 1);
+            if (diff < 0)
+                return {};
+            if constexpr (SingleConsumer) {
+                m_head.store(pos + 1, std::memory_order_relaxed);
+                break;
+            } else if (diff == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed))
+                    break;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        std::optional<value_type> result(c->slot.take());
+        c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return result;
+    }
+
+    template <class OutputIt>
+    std::size_t try_pop_n(OutputIt out, std::size_t max) {
+        std::size_t count = 0;
+        for (; count < max; ++count) {
+            auto value = try_pop();
+            if (!value)
+                break;
+            *out++ = std::move(*value);
+        }
+        return count;
+    }
+
+    // Approximate while other threads are pushing or popping
+    std::size_t size() const {
+        std::size_t head = m_head.load(std::memory_order_acquire);
+        std::size_t tail = m_tail.load(std::memory_order_acquire);
+        return tail - head;
+    }
+
+    std::size_t capacity() const { return m_mask + 1; }
+
+private:
+    struct cell {
+        std::atomic<std::size_t> sequence;
+        ring_slot<T> slot;
+    };
+
+    const std::size_t m_mask;
+    const std::unique_ptr<cell[]> m_cells;
+    alignas(cache_line_size) std::atomic<std::size_t> m_tail{0};
+    alignas(cache_line_size) std::atomic<std::size_t> m_head{0};
+};
+
+} // namespace detail
+
+/**
+ * @brief Lock-free bounded multi-producer multi-consumer ring buffer
+ *
+ * For use as the Buffer of a stream_queue. Capacity is rounded up to a power
+ * of two.
+ */
+template <class T>
+using mpmc_ring_buffer = detail::sequenced_ring_buffer<T, false>;
+
+/**
+ * @brief Lock-free bounded multi-producer single-consumer ring buffer
+ *
+ * Only valid if a single thread ever pops, e.g. the output of several
+ * parallel_streams threads read by one loop.
+ */
+template <class T>
+using mpsc_ring_buffer = detail::sequenced_ring_buffer<T, true>;
+
+/**
+ * @brief Lock-free bounded single-producer single-consumer ring buffer
+ *
+ * Only valid if a single thread ever pushes and a single thread ever pops,
+ * e.g. between two single threaded stages. Each side caches the other side's
+ * index so it only touches the shared cache line when it appears full or
+ * empty.
+ */
+template <class T> class spsc_ring_buffer {
+public:
+    using value_type = T;
+
+    explicit spsc_ring_buffer(std::size_t capacity = default_ring_capacity)
+        : m_mask(detail::ring_capacity(capacity) - 1),
+          m_slots(new detail::ring_slot<T>[m_mask + 1]) {}
+    ~spsc_ring_buffer() {
+        while (try_pop())
+            ;
+    }
+    spsc_ring_buffer(const spsc_ring_buffer &other) = delete;
+    spsc_ring_buffer &operator=(const spsc_ring_buffer &other) = delete;
+
+    // Returns false without touching value if the buffer is full
+    template <class V> bool try_push(V &&value) {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_headCache > m_mask) {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if (tail - m_headCache > m_mask)
+                return false;
+        }
+        m_slots[tail & m_mask].construct(std::forward<V>(value));
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Publishes the whole batch with a single store
+    template <class InputIt> InputIt try_push_range(InputIt first, InputIt last) {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        std::size_t end = tail;
+        for (; first != last; ++first, ++end) {
+            if (end - m_headCache > m_mask) {
+                m_headCache = m_head.load(std::memory_order_acquire);
+                if (end - m_headCache > m_mask)
+                    break;
+            }
+            m_slots[end & m_mask].construct(*first);
+        }
+        if (end != tail)
+            m_tail.store(end, std::memory_order_release);
+        return first;
+    }
+
+    std::optional<value_type> try_pop() {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tailCache) {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tailCache)
+                return {};
+        }
+        std::optional<value_type> result(m_slots[head & m_mask].take());
+        m_head.store(head + 1, std::memory_order_release);
+        return result;
+    }
+
+    // Frees the whole batch with a single store
+    template <class OutputIt>
+    std::size_t try_pop_n(OutputIt out, std::size_t max) {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        if (m_tailCache - head < max)
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+        std::size_t count = std::min(max, m_tailCache - head);
+        for (std::size_t i = 0; i < count; ++i)
+            *out++ = m_slots[(head + i) & m_mask].take();
+        if (count)
+            m_head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // Approximate while other threads are pushing or popping
+    std::size_t size() const {
+        std::size_t head = m_head.load(std::memory_order_acquire);
+        std::size_t tail = m_tail.load(std::memory_order_acquire);
+        return tail - head;
+    }
+
+    std::size_t capacity() const { return m_mask + 1; }
+
+private:
+    const std::size_t m_mask;
+    const std::unique_ptr<detail::ring_slot<T>[]> m_slots;
+
+    // Producer side
+    alignas(cache_line_size) std::atomic<std::size_t> m_tail{0};
+    std::size_t m_headCache{0};
+
+    // Consumer side
+    alignas(cache_line_size) std::atomic<std::size_t> m_head{0};
+    std::size_t m_tailCache{0};
+};
+
+} // namespace psp
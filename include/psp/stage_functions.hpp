@@ -0,0 +1,447 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "function_traits.hpp"
+
+namespace psp {
+
+namespace detail {
+
+// Placeholder for no function, e.g. a pipeline with nothing mapped yet
+struct unmapped {};
+
+// Calls pre on the item, if there is one
+template <class Pre, class Item> decltype(auto) premap(Pre &pre, Item &item) {
+    if constexpr (std::is_same_v<Pre, unmapped>)
+        return (item);
+    else
+        return pre(item);
+}
+
+// The type of the item after premap(), given the type the function accepts
+template <class Pre, class Arg> struct premapped {
+    using type = typename function_traits<Pre>::return_type;
+};
+template <class Arg> struct premapped<unmapped, Arg> {
+    using type = std::decay_t<Arg>;
+};
+
+template <class Func, std::size_t I>
+using arg_type_t =
+    std::tuple_element_t<I, typename function_traits<Func>::arg_types>;
+
+template <class T> struct is_optional : std::false_type {};
+template <class T> struct is_optional<std::optional<T>> : std::true_type {};
+
+// Per-thread cache of the states stateful_functions last used on the thread,
+// so most calls find theirs without a lock. Entries are keyed by a serial
+// number that is never reused, so stale ones are never matched.
+struct state_cache {
+    static constexpr std::size_t size = 8;
+    struct entry {
+        std::uint64_t serial{0};
+        void *state{nullptr};
+    };
+    static entry &lookup(std::uint64_t serial) {
+        thread_local entry entries[size];
+        return entries[serial % size];
+    }
+    static std::uint64_t next_serial() {
+        static std::atomic<std::uint64_t> next{1};
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+} // namespace detail
+
+// Contiguous run of items, as std::span in C++20
+template <class T> class span {
+public:
+    using element_type = T;
+    using value_type = std::remove_cv_t<T>;
+    using iterator = T *;
+
+    span() = default;
+    span(T *data, std::size_t size) : m_data(data), m_size(size) {}
+
+    T *data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    T &operator[](std::size_t i) const { return m_data[i]; }
+    iterator begin() const { return m_data; }
+    iterator end() const { return m_data + m_size; }
+
+private:
+    T *m_data{nullptr};
+    std::size_t m_size{0};
+};
+
+// Passed to flat_map functions that take a second argument. Each call adds
+// an output item.
+template <class T> class emitter {
+public:
+    using value_type = T;
+    explicit emitter(std::vector<T> &outputs) : m_outputs(outputs) {}
+    template <class V> void operator()(V &&value) {
+        m_outputs.emplace_back(std::forward<V>(value));
+    }
+
+private:
+    std::vector<T> &m_outputs;
+};
+
+/**
+ * @brief Stage function that only passes some items on
+ *
+ * Wraps either a predicate, returning bool, in which case items it accepts
+ * are pushed as they are, or a function returning std::optional, in which
+ * case only engaged results are pushed. Nothing is pushed for rejected items,
+ * rather than an empty std::optional for the next stage to skip. Pre, if
+ * given, maps each item before the predicate sees it.
+ *
+ * Example:
+ * @code
+ * parallel_streams odd(input.begin(), input.end(),
+ *                      filter([](int i) { return i % 2 == 1; }));
+ * @endcode
+ */
+template <class Func, class Pre = detail::unmapped> class filter_function {
+public:
+    using result_type = typename function_traits<Func>::return_type;
+    static constexpr bool is_predicate = std::is_same_v<result_type, bool>;
+    static_assert(is_predicate || detail::is_optional<result_type>(),
+                  "filter() functions must return bool or std::optional");
+
+private:
+    template <bool Predicate, class = void> struct output {
+        using type =
+            typename detail::premapped<Pre, detail::arg_type_t<Func, 0>>::type;
+    };
+    template <class Dummy> struct output<false, Dummy> {
+        using type = typename result_type::value_type;
+    };
+
+public:
+    using output_type = typename output<is_predicate>::type;
+
+    explicit filter_function(Func func, Pre pre = {})
+        : m_func(std::move(func)), m_pre(std::move(pre)) {}
+
+    // Appends the result for one item, if any. Kept items are moved only if
+    // the stage owns them, i.e. when given an rvalue or a mapped value.
+    // Borrowed items, such as elements of a random access input read in
+    // place, are copied.
+    template <class Item>
+    void operator()(Item &&item, std::vector<output_type> &outputs) {
+        decltype(auto) value = detail::premap(m_pre, item);
+        if constexpr (is_predicate) {
+            constexpr bool owned =
+                !std::is_lvalue_reference_v<decltype(value)> ||
+                !std::is_lvalue_reference_v<Item>;
+            if (m_func(value)) {
+                if constexpr (owned)
+                    outputs.push_back(std::move(value));
+                else
+                    outputs.push_back(value);
+            }
+        } else {
+            result_type result = m_func(value);
+            if (result)
+                outputs.push_back(std::move(*result));
+        }
+    }
+
+    // The same filter, applied to pre(item) rather than the item
+    template <class First> filter_function<Func, First> after(First pre) const {
+        static_assert(std::is_same_v<Pre, detail::unmapped>,
+                      "filter already has a function before it");
+        return filter_function<Func, First>(m_func, std::move(pre));
+    }
+
+private:
+    Func m_func;
+    Pre m_pre;
+};
+
+/**
+ * @brief Stage function that produces any number of items per input
+ *
+ * Wraps either a function returning a range, such as a std::vector, whose
+ * items are pushed individually, or a function taking an emitter<T>& as its
+ * second argument and calling it once per output. The emitter form avoids
+ * building a container for every input. Either way, the outputs of a batch of
+ * inputs are pushed to the stream_queue together.
+ *
+ * Example:
+ * @code
+ * parallel_streams words(lines.begin(), lines.end(),
+ *     flat_map([](const std::string &line, emitter<std::string> &emit) {
+ *         std::istringstream stream(line);
+ *         for (std::string word; stream >> word;)
+ *             emit(std::move(word));
+ *     }));
+ * @endcode
+ */
+template <class Func, class Pre = detail::unmapped> class flat_map_function {
+public:
+    static constexpr bool uses_emitter =
+        std::tuple_size_v<typename function_traits<Func>::arg_types> == 2;
+
+private:
+    template <bool Emitter, class = void> struct output {
+        using result_type = typename function_traits<Func>::return_type;
+        using type = std::decay_t<decltype(*std::begin(
+            std::declval<result_type &>()))>;
+    };
+    template <class Dummy> struct output<true, Dummy> {
+        using type =
+            typename std::decay_t<detail::arg_type_t<Func, 1>>::value_type;
+    };
+
+public:
+    using output_type = typename output<uses_emitter>::type;
+
+    explicit flat_map_function(Func func, Pre pre = {})
+        : m_func(std::move(func)), m_pre(std::move(pre)) {}
+
+    // Appends all results for one item. The item is only read, never moved
+    // from, as it may be borrowed from the input.
+    template <class Item>
+    void operator()(Item &&item, std::vector<output_type> &outputs) {
+        decltype(auto) value = detail::premap(m_pre, item);
+        if constexpr (uses_emitter) {
+            emitter<output_type> emit(outputs);
+            m_func(value, emit);
+        } else {
+            auto range = m_func(value);
+            outputs.insert(outputs.end(),
+                           std::make_move_iterator(std::begin(range)),
+                           std::make_move_iterator(std::end(range)));
+        }
+    }
+
+    // The same flat_map, applied to pre(item) rather than the item
+    template <class First>
+    flat_map_function<Func, First> after(First pre) const {
+        static_assert(std::is_same_v<Pre, detail::unmapped>,
+                      "flat_map already has a function before it");
+        return flat_map_function<Func, First>(m_func, std::move(pre));
+    }
+
+private:
+    Func m_func;
+    Pre m_pre;
+};
+
+/**
+ * @brief Stage function with scratch state for each thread calling it
+ *
+ * Wraps func(State &, item), where State is whatever factory() returns, such
+ * as a decompression context or a reusable buffer. Each thread gets its own
+ * State, made by calling factory() on that thread the first time it calls the
+ * function, so the memory is local to it and nothing needs locking. factory
+ * may be called from several threads at once. States live until the function
+ * is destroyed. Copies of the function start with no states.
+ *
+ * Stages hold their own copy of their function, so for_each_state() on the
+ * original never sees the states a stage made. To inspect them, give the
+ * stage a lambda that calls the original by reference instead.
+ *
+ * Example:
+ * @code
+ * parallel_streams decoded(blocks.begin(), blocks.end(),
+ *     with_state([] { return decoder(); },
+ *                [](decoder &d, const block &b) { return d.decode(b); }));
+ * @endcode
+ *
+ * @code
+ * // Blocks decoded by each thread
+ * auto counted = with_state([] { return 0; },
+ *                           [](int &n, const block &b) {
+ *                               ++n;
+ *                               return decode(b);
+ *                           });
+ * parallel_streams decoded(blocks.begin(), blocks.end(),
+ *     [&counted](const block &b) { return counted(b); });
+ * ...
+ * counted.for_each_state([](int &n) { std::cout << n << std::endl; });
+ * @endcode
+ */
+template <class Factory, class Func> class stateful_function {
+public:
+    using state_type = std::decay_t<std::invoke_result_t<Factory &>>;
+    using arg_type = detail::arg_type_t<Func, 1>;
+    using result_type = typename function_traits<Func>::return_type;
+
+    stateful_function(Factory factory, Func func)
+        : m_factory(std::move(factory)), m_func(std::move(func)) {}
+    stateful_function(const stateful_function &other)
+        : m_factory(other.m_factory), m_func(other.m_func) {}
+    stateful_function(stateful_function &&other)
+        : m_factory(std::move(other.m_factory)),
+          m_func(std::move(other.m_func)) {}
+    stateful_function &operator=(const stateful_function &other) = delete;
+
+    result_type operator()(arg_type item) {
+        return m_func(local_state(), std::forward<arg_type>(item));
+    }
+
+    // Calls visit(State &) on every thread's state, e.g. to merge per-thread
+    // results. Must not race with calls to the function.
+    template <class Visit> void for_each_state(Visit &&visit) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for (auto &entry : m_states)
+            visit(*entry.second);
+    }
+
+private:
+    state_type &local_state() {
+        detail::state_cache::entry &cached =
+            detail::state_cache::lookup(m_serial);
+        if (cached.serial == m_serial)
+            return *static_cast<state_type *>(cached.state);
+        // Only this thread adds its own state, so it can be made without
+        // holding the lock
+        std::thread::id id = std::this_thread::get_id();
+        state_type *state = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            auto it = m_states.find(id);
+            if (it != m_states.end())
+                state = it->second.get();
+        }
+        if (!state) {
+            auto created = std::make_unique<state_type>(m_factory());
+            state = created.get();
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_states.emplace(id, std::move(created));
+        }
+        cached.serial = m_serial;
+        cached.state = state;
+        return *state;
+    }
+
+    Factory m_factory;
+    Func m_func;
+    const std::uint64_t m_serial{detail::state_cache::next_serial()};
+    std::mutex m_mutex;
+    std::unordered_map<std::thread::id, std::unique_ptr<state_type>> m_states;
+};
+
+/**
+ * @brief Stage function that transforms a whole batch of items per call
+ *
+ * Wraps func(span<const In> inputs, span<Out> outputs), which must write one
+ * output per input. Seeing a contiguous run of items lets the compiler
+ * vectorize simple arithmetic loops. Batches are claimed ranges of a random
+ * access input or runs popped from a queue, up to stream_options::batch_size
+ * items, or default_span_batch if that is left at one. Outputs are default
+ * constructed before the call.
+ *
+ * Example:
+ * @code
+ * parallel_streams halves(input.begin(), input.end(),
+ *     batch_map([](span<const float> in, span<float> out) {
+ *         for (std::size_t i = 0; i < in.size(); ++i)
+ *             out[i] = in[i] * 0.5f;
+ *     }));
+ * @endcode
+ */
+template <class Func> class batch_map_function {
+public:
+    using input_type =
+        typename std::decay_t<detail::arg_type_t<Func, 0>>::value_type;
+    using output_type =
+        typename std::decay_t<detail::arg_type_t<Func, 1>>::value_type;
+
+    explicit batch_map_function(Func func) : m_func(std::move(func)) {}
+
+    void operator()(span<const input_type> inputs, span<output_type> outputs) {
+        m_func(inputs, outputs);
+    }
+
+private:
+    Func m_func;
+};
+
+// Items per batch_map call unless stream_options::batch_size is given
+inline constexpr std::size_t default_span_batch = 256;
+
+template <class Func> batch_map_function<Func> batch_map(Func func) {
+    return batch_map_function<Func>(std::move(func));
+}
+
+template <class Factory, class Func>
+stateful_function<Factory, Func> with_state(Factory factory, Func func) {
+    return stateful_function<Factory, Func>(std::move(factory),
+                                            std::move(func));
+}
+
+template <class Func> filter_function<Func> filter(Func func) {
+    return filter_function<Func>(std::move(func));
+}
+
+template <class Func> flat_map_function<Func> flat_map(Func func) {
+    return flat_map_function<Func>(std::move(func));
+}
+
+// How a stage function's results become output items. Plain functions
+// produce exactly one item per input. filter() and flat_map() functions
+// produce any number and are called with a vector to append them to.
+// batch_map() functions produce one per input, but are called with spans of
+// a whole batch.
+template <class Func> struct stage_traits {
+    using output_type = typename function_traits<Func>::return_type;
+    static constexpr bool one_to_one = true;
+    static constexpr bool batched = false;
+};
+
+// Nothing mapped yet, which is trivially one to one
+template <> struct stage_traits<detail::unmapped> {
+    static constexpr bool one_to_one = true;
+    static constexpr bool batched = false;
+};
+
+template <class Func, class Pre>
+struct stage_traits<filter_function<Func, Pre>> {
+    using output_type = typename filter_function<Func, Pre>::output_type;
+    static constexpr bool one_to_one = false;
+    static constexpr bool batched = false;
+};
+
+template <class Func, class Pre>
+struct stage_traits<flat_map_function<Func, Pre>> {
+    using output_type = typename flat_map_function<Func, Pre>::output_type;
+    static constexpr bool one_to_one = false;
+    static constexpr bool batched = false;
+};
+
+template <class Func> struct stage_traits<batch_map_function<Func>> {
+    using output_type = typename batch_map_function<Func>::output_type;
+    static constexpr bool one_to_one = true;
+    static constexpr bool batched = true;
+};
+
+template <class Func>
+using stage_output_t = typename stage_traits<Func>::output_type;
+
+} // namespace psp
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Define to 1 to collect runtime statistics. Must be the same in every
+// translation unit, e.g. with target_compile_definitions(). When 0, the
+// counters are empty types and every update compiles to nothing.
+#ifndef PSP_ENABLE_STATS
+#define PSP_ENABLE_STATS 0
+#endif
+
+namespace psp {
+
+inline constexpr bool stats_enabled = PSP_ENABLE_STATS != 0;
+
+// Snapshots of the counters below. They are always defined so code reading
+// them compiles either way, and are all zero when stats are disabled. Times
+// are in nanoseconds.
+
+// Returned by stream_queue::stats()
+struct queue_stats {
+    std::uint64_t pushed{0};
+    std::uint64_t popped{0};
+
+    // Most items ever waiting in the queue at once
+    std::uint64_t high_water{0};
+
+    // Time writers slept on a full queue and readers on an empty one
+    std::uint64_t push_wait_ns{0};
+    std::uint64_t pop_wait_ns{0};
+};
+
+// Histogram of recorded values in power of two buckets. Bucket zero counts
+// zeros and bucket i counts values from 2^(i-1) up to 2^i - 1.
+struct distribution {
+    static constexpr std::size_t bucket_count = 65;
+    std::array<std::uint64_t, bucket_count> buckets{};
+    std::uint64_t count{0};
+    std::uint64_t sum{0};
+    std::uint64_t max{0};
+
+    static std::size_t bucket(std::uint64_t value) {
+        std::size_t result = 0;
+        for (; value; value >>= 1)
+            ++result;
+        return result;
+    }
+
+    double mean() const { return count ? double(sum) / double(count) : 0.0; }
+
+    // Upper bound of the bucket holding the p'th fraction of values, with p
+    // from zero to one, capped at the largest value seen
+    std::uint64_t percentile(double p) const {
+        std::uint64_t target = std::uint64_t(p * double(count));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            seen += buckets[i];
+            if (seen > target || (seen == count && seen)) {
+                std::uint64_t upper =
+                    i == 0 ? 0 : i >= 64 ? ~std::uint64_t(0)
+                                         : (std::uint64_t(1) << i) - 1;
+                return upper < max ? upper : max;
+            }
+        }
+        return 0;
+    }
+};
+
+// Returned by iterable_processor::stats()
+struct stage_stats {
+    std::uint64_t items_in{0};
+    std::uint64_t items_out{0};
+
+    // Time spent in the stage's function
+    std::uint64_t function_ns{0};
+
+    // Time threads spent claiming input and pushing output when allowed to
+    // block, i.e. not on a thread_pool
+    std::uint64_t input_wait_ns{0};
+    std::uint64_t output_wait_ns{0};
+
+    // Items claimed from the input at once and, with a batch timeout, time
+    // spent filling each batch after its first item arrived
+    distribution batch_size;
+    distribution batch_wait_ns;
+
+    queue_stats output;
+};
+
+// Returned by thread_pool::stats(), one per worker
+struct worker_stats {
+    std::uint64_t calls{0};
+
+    // Time calling multitasks and time asleep with nothing to call
+    std::uint64_t busy_ns{0};
+    std::uint64_t idle_ns{0};
+};
+
+namespace detail {
+
+inline std::uint64_t stats_now_ns() {
+    return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now().time_since_epoch())
+                             .count());
+}
+
+// Relaxed counter that may be read while other threads update it
+template <bool Enabled = stats_enabled> class stat_counter {
+public:
+    void add(std::uint64_t value) {
+        m_value.fetch_add(value, std::memory_order_relaxed);
+    }
+    void sub(std::uint64_t value) {
+        m_value.fetch_sub(value, std::memory_order_relaxed);
+    }
+
+    // Raises the value to at least value
+    void max(std::uint64_t value) {
+        std::uint64_t current = m_value.load(std::memory_order_relaxed);
+        while (current < value &&
+               !m_value.compare_exchange_weak(current, value,
+                                              std::memory_order_relaxed))
+            ;
+    }
+    std::uint64_t load() const {
+        return m_value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<std::uint64_t> m_value{0};
+};
+
+template <> class stat_counter<false> {
+public:
+    void add(std::uint64_t) {}
+    void sub(std::uint64_t) {}
+    void max(std::uint64_t) {}
+    std::uint64_t load() const { return 0; }
+};
+
+// Concurrently recorded distribution
+template <bool Enabled = stats_enabled> class stat_distribution {
+public:
+    void add(std::uint64_t value) {
+        m_buckets[distribution::bucket(value)].add(1);
+        m_count.add(1);
+        m_sum.add(value);
+        m_max.max(value);
+    }
+    distribution load() const {
+        distribution result;
+        for (std::size_t i = 0; i < distribution::bucket_count; ++i)
+            result.buckets[i] = m_buckets[i].load();
+        result.count = m_count.load();
+        result.sum = m_sum.load();
+        result.max = m_max.load();
+        return result;
+    }
+
+private:
+    std::array<stat_counter<Enabled>, distribution::bucket_count> m_buckets;
+    stat_counter<Enabled> m_count;
+    stat_counter<Enabled> m_sum;
+    stat_counter<Enabled> m_max;
+};
+
+template <> class stat_distribution<false> {
+public:
+    void add(std::uint64_t) {}
+    distribution load() const { return {}; }
+};
+
+// Adds the time until it is destroyed to a counter
+template <bool Enabled = stats_enabled> class stat_timer {
+public:
+    explicit stat_timer(stat_counter<Enabled> &counter)
+        : m_counter(counter), m_start(stats_now_ns()) {}
+    ~stat_timer() { m_counter.add(stats_now_ns() - m_start); }
+    stat_timer(const stat_timer &other) = delete;
+    stat_timer &operator=(const stat_timer &other) = delete;
+
+private:
+    stat_counter<Enabled> &m_counter;
+    std::uint64_t m_start;
+};
+
+template <> class stat_timer<false> {
+public:
+    explicit stat_timer(stat_counter<false> &) {}
+};
+
+} // namespace detail
+
+} // namespace psp
@@ -10,14 +10,23 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <iterator>
 #include <mutex>
 #include <optional>
 #include <queue>
 #include <thread>
 #include <type_traits>
+#include <vector>
 
 #include "function_traits.hpp"
+#include "indexed_processing.hpp"
+#include "stage_functions.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 #include "stream_queue.hpp"
 
 // TODO: split to another file, along with parallel_streams
@@ -28,47 +37,544 @@ namespace psp {
 template <typename> struct is_tuple : std::false_type {};
 template <typename... T> struct is_tuple<std::tuple<T...>> : std::true_type {};
 
-template <class InputIterator, class Func> class iterable_processor {
+// Detects iterators that can be split by index without locking, such as
+// std::vector's. Requires working arithmetic rather than trusting the category.
+template <class Iterator, class = void>
+struct is_random_access_input : std::false_type {};
+template <class Iterator>
+struct is_random_access_input<
+    Iterator,
+    std::enable_if_t<
+        std::is_base_of_v<std::random_access_iterator_tag,
+                          typename Iterator::iterator_category> &&
+        std::is_convertible_v<decltype(std::declval<Iterator>() -
+                                       std::declval<Iterator>()),
+                              std::ptrdiff_t>,
+        std::void_t<decltype(std::declval<Iterator>()[std::size_t()])>>>
+    : std::true_type {};
+
+// Detects iterators that can pop a batch of items at once, such as
+// consuming_queue_iterator
+template <class Iterator, class = void> struct has_pop_n : std::false_type {};
+template <class Iterator>
+struct has_pop_n<Iterator, std::void_t<decltype(std::declval<Iterator &>().pop_n(
+                               std::declval<typename Iterator::value_type *>(),
+                               std::size_t()))>> : std::true_type {};
+
+namespace detail {
+
+// Iterators known to point into an array, so a range of them can be passed
+// as a span
+template <class Iterator> constexpr bool is_contiguous_iterator() {
+    using value_type = typename std::iterator_traits<Iterator>::value_type;
+    if constexpr (std::is_pointer_v<Iterator>)
+        return true;
+    else if constexpr (std::is_same_v<value_type, bool>)
+        return false;
+    else
+        return std::is_same_v<Iterator,
+                              typename std::vector<value_type>::iterator> ||
+               std::is_same_v<Iterator,
+                              typename std::vector<value_type>::const_iterator>;
+}
+
+} // namespace detail
+
+// Queue depth that counts as full when autoscaling a stage with an unbounded
+// queue. See iterable_processor::pressure().
+inline constexpr std::size_t autoscale_depth = 256;
+
+// Optional settings for stream_processor and parallel_streams
+struct stream_options {
+    // Maximum number of items in the output queue before the stage stops
+    // producing. Zero selects the OutputBuffer's default, which is unbounded
+    // for locked_buffer.
+    std::size_t capacity{0};
+
+    // Number of items each thread claims from the input and pushes to the
+    // output at once. Larger batches spread the synchronization cost over
+    // more items, at the cost of load balance and latency.
+    std::size_t batch_size{1};
+
+    // For queue inputs, how long a thread waits for a batch to fill after
+    // its first item arrives. Zero takes whatever is available. Only threads
+    // that may block wait, so stages on a thread_pool ignore it.
+    std::chrono::microseconds batch_timeout{0};
+
+    // For random access inputs, which threads claim with an atomic cursor
+    // rather than a lock, the most items a thread claims at once. Zero lets
+    // claims start large and shrink toward the end of the input.
+    std::size_t grain_size{0};
+
+    // Push outputs in input order. Items that finish early wait in a
+    // reorder_buffer until everything before them has been pushed.
+    bool ordered{false};
+
+    // In ordered mode, how far past the oldest unfinished item threads may
+    // claim new input. Bounds the reorder buffer's memory and how much a slow
+    // item can hold up the rest.
+    std::size_t reorder_window{1024};
+
+    // With a thread_pool that autoscale()s, the fewest and most workers the
+    // stage may be given. A maximum of zero means the pool size.
+    std::size_t min_threads{1};
+    std::size_t max_threads{0};
+
+    // Label for the stage's trace events. Must outlive any trace_session,
+    // e.g. a string literal.
+    const char *name{"stage"};
+};
+
+template <class InputIterator, class Func,
+          class OutputBuffer =
+              locked_buffer<stage_output_t<Func>>>
+class iterable_processor {
 public:
     using input_value_type = typename InputIterator::value_type;
-    using function_arg0_type = std::tuple_element_t<0, typename function_traits<Func>::arg_types>;
-    using output_value_type = typename function_traits<Func>::return_type;
+    using output_value_type = stage_output_t<Func>;
+    using output_queue_type = stream_queue<output_value_type, OutputBuffer>;
 
     iterable_processor(InputIterator begin, InputIterator end,
-                       stream_queue<output_value_type> &output,
-                       const Func &func)
-        : m_inputBegin(begin), m_inputEnd(end), m_output(output), m_func(func) {
+                       output_queue_type &output, Func func,
+                       const stream_options &options = {})
+        : m_func(std::move(func)), m_inputBegin(begin), m_inputEnd(end),
+          m_output(output),
+          m_batchSize(options.batch_size > 1 ? options.batch_size
+                      : batched                  ? default_span_batch
+                                                 : 1),
+          m_grainSize(options.grain_size),
+          m_batchTimeout(options.batch_timeout),
+          m_name(options.name ? options.name : "stage") {
+        if (options.ordered)
+            m_reorder.emplace(options.reorder_window);
+        if constexpr (is_random_access_input<InputIterator>())
+            m_inputSize = static_cast<std::size_t>(end - begin);
     }
 
-    void process_all() {
-        auto p = make_processor();
-        while (p())
+    // Process everything on the calling thread, waiting whenever the output
+    // queue is full
+    void process_all() { process_all(m_output.make_writer()); }
+
+    // As process_all(), but pushing through a writer made beforehand, so
+    // the output cannot close before every thread has started
+    template <class Writer> void process_all(Writer writer) {
+        while (process_some(writer, true))
             ;
     }
 
-    std::function<bool()> make_processor() {
+    // Counters so far, while the stage is running. All zero unless
+    // PSP_ENABLE_STATS is set.
+    stage_stats stats() const {
+        stage_stats result;
+        result.items_in = m_stats.itemsIn.load();
+        result.items_out = m_stats.itemsOut.load();
+        result.function_ns = m_stats.functionNs.load();
+        result.input_wait_ns = m_stats.inputWaitNs.load();
+        result.output_wait_ns = m_stats.outputWaitNs.load();
+        result.batch_size = m_stats.batchSize.load();
+        result.batch_wait_ns = m_stats.batchWaitNs.load();
+        result.output = m_output.stats();
+        return result;
+    }
+
+    // Load signal for thread_pool autoscaling: how full the input is, less
+    // how full the output is, each between zero and one. Positive when this
+    // stage is falling behind and negative when the next one is. Unbounded
+    // queues count as full at autoscale_depth items. Inputs other than
+    // queues count as full until they end.
+    double pressure() {
+        double input = 0.0;
+        if constexpr (is_random_access_input<InputIterator>()) {
+            input = m_inputCursor.load(std::memory_order_relaxed) < m_inputSize
+                        ? 1.0
+                        : 0.0;
+        } else if constexpr (has_pop_n<InputIterator>()) {
+            std::lock_guard<std::mutex> lk(m_inputMutex);
+            input = fill(m_inputBegin.size(), m_inputBegin.capacity());
+        } else {
+            input = m_inputEnded.load() ? 0.0 : 1.0;
+        }
+        return input - fill(m_output.size() + m_parkedCount.load(),
+                            m_output.capacity());
+    }
+
+    // Threads calling process_all(), or with a thread_pool, how many workers
+    // have a handle to the task. Guided scheduling shares the remaining input
+    // between them.
+    size_t concurrency() const { return m_concurrency.load(); }
+    void set_concurrency(size_t concurrency) { m_concurrency = concurrency; }
+
+    // Stops upstream stages once nothing will read this one's output, by
+    // cancelling a queue input. See stream_queue::cancel(). An input that
+    // has ended is left alone, as its stage may already be destroyed.
+    void cancel_input() {
+        if constexpr (has_pop_n<InputIterator>())
+            if (!m_inputEnded.load())
+                m_inputBegin.cancel();
+    }
+
+    // Returns a thread_pool multitask that processes one item, or one batch,
+    // per call. It never waits on a full output queue, or an empty input
+    // queue, as the task at the other end may need the same pool thread.
+    // Instead, outputs that do not fit are parked and the task yields until
+    // they can be pushed. Rather than polling, the task returns
+    // task_status::waiting and the queues wake it once the output has space
+    // or a queue input has items.
+    thread_pool::multitask make_processor() {
         auto writer = m_output.make_writer();
-        return [this, writer]() mutable -> bool {
-            auto item = getOneInput();
-            bool hasItem = item.has_value();
-            if (hasItem) {
-                // NOTE: TOTALLY UNTESTED!
-                // Automatically expand inputs of tuples to function arguments,
-                // unless the function intends to take a tuple as the first
-                // argument
-                if constexpr (is_tuple<input_value_type>() &&
-                              !is_tuple<function_arg0_type>())
-                    writer.push(std::apply(m_func, *item));
-                else
-                    writer.push(m_func(*item));
+        return [this, writer]() mutable -> task_status {
+            if (!push_parked(writer)) {
+                auto waker = thread_pool::current_waker();
+                if (waker && writer.notify_when_space(std::move(waker)))
+                    return task_status::waiting;
+                return task_status::ready;
             }
-            return hasItem;
+
+            // Count the item before claiming it, so another thread cannot see
+            // the end of the input and retire the task while it is in flight.
+            // Whichever thread is last out after the end of the input retires
+            // the task.
+            ++m_inFlight;
+            bool claimed = process_some(writer, false);
+            bool finished = --m_inFlight == 0 && m_inputEnded.load() &&
+                            !m_parkedCount.load();
+            if (finished)
+                return task_status::finished;
+            if (claimed || m_inputEnded.load())
+                return task_status::ready;
+            if (wait_for_window() || wait_for_input())
+                return task_status::waiting;
+            return task_status::ready;
         };
     }
 
 private:
-    std::optional<input_value_type> getOneInput() {
+    static constexpr bool one_to_one = stage_traits<Func>::one_to_one;
+    static constexpr bool batched = stage_traits<Func>::batched;
+
+    // Ordered mode holds one output per input, or for filter and flat_map
+    // stages, one group of outputs per input
+    using reorder_value_type =
+        std::conditional_t<one_to_one, output_value_type,
+                           std::vector<output_value_type>>;
+
+    static double fill(std::size_t size, std::size_t capacity) {
+        return std::min(1.0, double(size) / double(std::min(
+                                                capacity, autoscale_depth)));
+    }
+
+    // Asks a queue input to wake the calling thread_pool task when it has
+    // more. Returns false if it cannot, or if the input is already ready.
+    bool wait_for_input() {
+        if constexpr (has_pop_n<InputIterator>()) {
+            auto waker = thread_pool::current_waker();
+            if (!waker)
+                return false;
+            std::lock_guard<std::mutex> lk(m_inputMutex);
+            return m_inputBegin.notify_when_ready(std::move(waker));
+        } else {
+            return false;
+        }
+    }
+
+    // Asks the reorder buffer to wake the calling thread_pool task when the
+    // next input index is inside the window. Returns false if it cannot, or
+    // if the window has room.
+    bool wait_for_window() {
+        if (!m_reorder)
+            return false;
+        auto waker = thread_pool::current_waker();
+        if (!waker)
+            return false;
+        if constexpr (is_random_access_input<InputIterator>()) {
+            return m_reorder->notify_when_in_window(m_inputCursor.load(),
+                                                    std::move(waker));
+        } else {
+            std::lock_guard<std::mutex> lk(m_inputMutex);
+            return m_reorder->notify_when_in_window(m_inputIndex,
+                                                    std::move(waker));
+        }
+    }
+
+    // Claims and processes some input. With wait false, never waits for the
+    // output queue or the reorder window. Returns false if nothing was
+    // claimed, either at the end of the input or, without waiting, when the
+    // reorder window is full.
+    template <class Writer> bool process_some(Writer &writer, bool wait) {
+        detail::trace_scope<> scope(m_name, this);
+        if (m_output.cancelled()) {
+            cancel_input();
+            m_inputEnded = true;
+            return false;
+        }
+        if constexpr (is_random_access_input<InputIterator>()) {
+            std::size_t first, count;
+            if (!claim_range(first, count, wait))
+                return false;
+            m_stats.itemsIn.add(count);
+            m_stats.batchSize.add(count);
+            // Claimed ranges can be large, so stop partway if cancelled
+            if constexpr (one_to_one && !batched) {
+                if (m_batchSize == 1 && !m_reorder) {
+                    for (std::size_t i = first;
+                         i < first + count && !m_output.cancelled(); ++i)
+                        emit_one(writer, call(m_inputBegin[i]), wait);
+                    return true;
+                }
+            }
+            std::vector<output_value_type> outputs;
+            for (std::size_t i = first; i < first + count; i += m_batchSize) {
+                // Ordered mode must emit every claimed item to move the
+                // reorder window along
+                if (!m_reorder && m_output.cancelled())
+                    break;
+                std::size_t n = std::min(m_batchSize, first + count - i);
+                borrowed_inputs inputs{m_inputBegin + i, n};
+                process_batch(writer, i, inputs, outputs, wait);
+            }
+            return true;
+        } else {
+            if constexpr (one_to_one && !batched) {
+                if (m_batchSize == 1 && !m_reorder) {
+                    std::optional<input_value_type> item;
+                    {
+                        detail::stat_timer<> timer(m_stats.inputWaitNs);
+                        item = getOneInput(wait);
+                    }
+                    if (!item)
+                        return false;
+                    m_stats.itemsIn.add(1);
+                    m_stats.batchSize.add(1);
+                    emit_one(writer, call(pass_owned(*item)), wait);
+                    return true;
+                }
+            }
+            std::vector<input_value_type> inputs;
+            std::size_t index;
+            {
+                detail::stat_timer<> timer(m_stats.inputWaitNs);
+                if (!getInputs(inputs, index, wait))
+                    return false;
+            }
+            m_stats.itemsIn.add(inputs.size());
+            m_stats.batchSize.add(inputs.size());
+            std::vector<output_value_type> outputs;
+            process_batch(writer, index, inputs, outputs, wait);
+            return true;
+        }
+    }
+
+    // A batch of a random access input, read in place rather than copied
+    struct borrowed_inputs {
+        InputIterator first;
+        std::size_t count;
+        std::size_t size() const { return count; }
+        decltype(auto) operator[](std::size_t i) const { return first[i]; }
+    };
+
+    // Items taken from a queue or other input iterator belong to the stage,
+    // so are moved into functions that take them by value
+    template <class Item> decltype(auto) pass_owned(Item &item) {
+        using arg0_type =
+            std::tuple_element_t<0, typename function_traits<Func>::arg_types>;
+        if constexpr (std::is_lvalue_reference_v<arg0_type>)
+            return (item);
+        else
+            return std::move(item);
+    }
+
+    // Items of a batch for filter and flat_map functions, which move from
+    // rvalues. Borrowed items are passed as read from the input, so are
+    // copied, and owned ones are moved.
+    template <class Inputs>
+    static decltype(auto) pass_item(Inputs &inputs, std::size_t i) {
+        if constexpr (std::is_same_v<Inputs, borrowed_inputs>)
+            return inputs[i];
+        else
+            return std::move(inputs[i]);
+    }
+
+    // Calls the function on consecutive inputs starting at index and pushes
+    // the results. Filter and flat_map stages push however many items they
+    // produce, keeping each input's group together in ordered mode.
+    template <class Writer, class Inputs>
+    void process_batch(Writer &writer, std::size_t index, Inputs &inputs,
+                       std::vector<output_value_type> &outputs, bool wait) {
+        if constexpr (batched) {
+            call_batch(inputs, outputs);
+            emit(writer, index, outputs, wait);
+        } else if constexpr (one_to_one) {
+            call_all(inputs, outputs);
+            emit(writer, index, outputs, wait);
+        } else if (!m_reorder) {
+            outputs.clear();
+            {
+                detail::stat_timer<> timer(m_stats.functionNs);
+                for (std::size_t i = 0; i < inputs.size(); ++i)
+                    m_func(pass_item(inputs, i), outputs);
+            }
+            push_outputs(writer, outputs, wait);
+        } else {
+            std::vector<reorder_value_type> groups(inputs.size());
+            {
+                detail::stat_timer<> timer(m_stats.functionNs);
+                for (std::size_t i = 0; i < inputs.size(); ++i)
+                    m_func(pass_item(inputs, i), groups[i]);
+            }
+            m_reorder->insert(index, groups, [&](auto &run) {
+                outputs.clear();
+                for (auto &group : run)
+                    outputs.insert(outputs.end(),
+                                   std::make_move_iterator(group.begin()),
+                                   std::make_move_iterator(group.end()));
+                push_outputs(writer, outputs, wait);
+            });
+        }
+    }
+
+    template <class Item> output_value_type call(Item &&item) {
+        detail::stat_timer<> timer(m_stats.functionNs);
+        return invoke(std::forward<Item>(item));
+    }
+
+    template <class Item> output_value_type invoke(Item &&item) {
+        // NOTE: TOTALLY UNTESTED!
+        // Automatically expand inputs of tuples to function arguments,
+        // unless the function intends to take a tuple as the first
+        // argument
+        using function_arg0_type =
+            std::tuple_element_t<0, typename function_traits<Func>::arg_types>;
+        if constexpr (is_tuple<input_value_type>() &&
+                      !is_tuple<function_arg0_type>())
+            return std::apply(m_func, std::forward<Item>(item));
+        else
+            return m_func(std::forward<Item>(item));
+    }
+
+    template <class Inputs>
+    void call_all(Inputs &inputs, std::vector<output_value_type> &outputs) {
+        outputs.clear();
+        outputs.reserve(inputs.size());
+        detail::stat_timer<> timer(m_stats.functionNs);
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            if constexpr (std::is_same_v<Inputs, borrowed_inputs>)
+                outputs.push_back(invoke(inputs[i]));
+            else
+                outputs.push_back(invoke(pass_owned(inputs[i])));
+        }
+    }
+
+    // Calls a batch_map() function with the whole batch. Inputs must be
+    // contiguous, so batches borrowed from the input are copied unless they
+    // are already.
+    template <class Inputs>
+    void call_batch(Inputs &inputs, std::vector<output_value_type> &outputs) {
+        outputs.clear();
+        outputs.resize(inputs.size());
+        span<output_value_type> out(outputs.data(), outputs.size());
+        if constexpr (!std::is_same_v<Inputs, borrowed_inputs>) {
+            detail::stat_timer<> timer(m_stats.functionNs);
+            m_func(span<const input_value_type>(inputs.data(), inputs.size()),
+                   out);
+        } else if constexpr (detail::is_contiguous_iterator<InputIterator>()) {
+            detail::stat_timer<> timer(m_stats.functionNs);
+            m_func(span<const input_value_type>(&*inputs.first, inputs.size()),
+                   out);
+        } else {
+            std::vector<input_value_type> copy(inputs.first,
+                                               inputs.first + inputs.size());
+            detail::stat_timer<> timer(m_stats.functionNs);
+            m_func(span<const input_value_type>(copy.data(), copy.size()), out);
+        }
+    }
+
+    template <class Writer>
+    void emit_one(Writer &writer, output_value_type &&output, bool wait) {
+        m_stats.itemsOut.add(1);
+        detail::stat_timer<> timer(m_stats.outputWaitNs);
+        if (wait)
+            writer.push(std::move(output));
+        else if (!writer.try_push(std::move(output)))
+            park(std::move(output));
+    }
+
+    // Pushes outputs for consecutive inputs starting at index, via the
+    // reorder buffer in ordered mode
+    template <class Writer>
+    void emit(Writer &writer, std::size_t index,
+              std::vector<output_value_type> &outputs, bool wait) {
+        auto push = [this, &writer, wait](std::vector<output_value_type> &run) {
+            push_outputs(writer, run, wait);
+        };
+        if (m_reorder)
+            m_reorder->insert(index, outputs, push);
+        else
+            push(outputs);
+    }
+
+    // Pushes a run of outputs with one notification
+    template <class Writer>
+    void push_outputs(Writer &writer, std::vector<output_value_type> &run,
+                      bool wait) {
+        if (run.empty())
+            return;
+        m_stats.itemsOut.add(run.size());
+        detail::stat_timer<> timer(m_stats.outputWaitNs);
+        auto first = std::make_move_iterator(run.begin());
+        auto last = std::make_move_iterator(run.end());
+        if (wait) {
+            writer.push_range(first, last);
+            return;
+        }
+        // Queue behind anything already parked to keep ordered outputs in
+        // order
+        if (!m_parkedCount.load())
+            first = writer.try_push_range(first, last);
+        park(first, last);
+    }
+
+    void park(output_value_type &&output) {
+        std::lock_guard<std::mutex> lk(m_parkedMutex);
+        m_parked.push(std::move(output));
+        ++m_parkedCount;
+    }
+
+    template <class InputIt> void park(InputIt first, InputIt last) {
+        if (first == last)
+            return;
+        std::lock_guard<std::mutex> lk(m_parkedMutex);
+        for (; first != last; ++first) {
+            m_parked.push(*first);
+            ++m_parkedCount;
+        }
+    }
+
+    // Returns true if there is nothing left parked
+    template <class Writer> bool push_parked(Writer &writer) {
+        if (!m_parkedCount.load())
+            return true;
+        std::lock_guard<std::mutex> lk(m_parkedMutex);
+        while (!m_parked.empty()) {
+            if (!writer.try_push(std::move(m_parked.front())))
+                return false;
+            m_parked.pop();
+            --m_parkedCount;
+        }
+        return true;
+    }
+
+    // Without waiting, returns nothing if a queue input is empty but not yet
+    // closed, leaving m_inputEnded unset
+    std::optional<input_value_type> getOneInput(bool wait) {
         std::lock_guard<std::mutex> lk(m_inputMutex);
+        if constexpr (has_pop_n<InputIterator>()) {
+            if (!wait) {
+                auto item = m_inputBegin.try_pop();
+                if (!item && m_inputBegin.ended())
+                    m_inputEnded = true;
+                return item;
+            }
+        }
         bool hasItem = m_inputBegin != m_inputEnd;
         if (hasItem) {
             // TODO: is this safe? it is desirable to move from
@@ -81,23 +587,166 @@ private:
             else
                 return *m_inputBegin++;
         }
+        m_inputEnded = true;
         return {};
     }
 
+    // Claims up to m_batchSize items with a single lock and gives the input
+    // index of the first. In ordered mode, the first index must be inside
+    // the reorder window, so either wait or return false without claiming
+    // anything. Also returns false at the end of the input, or without
+    // waiting, when a queue input is empty.
+    bool getInputs(std::vector<input_value_type> &batch, std::size_t &index,
+                   bool wait) {
+        batch.clear();
+        std::lock_guard<std::mutex> lk(m_inputMutex);
+        if (m_reorder) {
+            if (wait)
+                m_reorder->wait_for_window(m_inputIndex);
+            else if (!m_reorder->in_window(m_inputIndex))
+                return false;
+        }
+        if constexpr (has_pop_n<InputIterator>()) {
+            // Takes what is available rather than waiting for a full batch,
+            // unless given a batch timeout
+            if (wait) {
+                m_inputBegin.pop_n(std::back_inserter(batch), m_batchSize);
+                if (m_batchTimeout.count() && !batch.empty() &&
+                    batch.size() < m_batchSize) {
+                    auto start = std::chrono::steady_clock::now();
+                    m_inputBegin.pop_n_until(std::back_inserter(batch),
+                                             m_batchSize - batch.size(),
+                                             start + m_batchTimeout);
+                    if constexpr (stats_enabled)
+                        m_stats.batchWaitNs.add(std::uint64_t(
+                            std::chrono::duration_cast<
+                                std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start)
+                                .count()));
+                }
+            } else if (!m_inputBegin.try_pop_n(std::back_inserter(batch),
+                                             m_batchSize) &&
+                     !m_inputBegin.ended())
+                return false;
+        } else {
+            for (; batch.size() < m_batchSize && m_inputBegin != m_inputEnd;
+                 ++m_inputBegin) {
+                if constexpr (std::is_same_v<
+                                  typename InputIterator::iterator_category,
+                                  std::input_iterator_tag>)
+                    batch.push_back(std::move(*m_inputBegin));
+                else
+                    batch.push_back(*m_inputBegin);
+            }
+        }
+        if (batch.empty()) {
+            m_inputEnded = true;
+            return false;
+        }
+        index = m_inputIndex;
+        m_inputIndex += batch.size();
+        return true;
+    }
+
+    // Lock-free version of getInputs() for random access inputs. Claims a
+    // contiguous range [first, first + count) by advancing m_inputCursor.
+    bool claim_range(std::size_t &first, std::size_t &count, bool wait) {
+        first = m_inputCursor.load(std::memory_order_relaxed);
+        for (;;) {
+            if (first >= m_inputSize) {
+                m_inputEnded = true;
+                return false;
+            }
+            if (m_reorder && !m_reorder->in_window(first)) {
+                if (!wait)
+                    return false;
+                m_reorder->wait_for_window(first);
+            }
+            count = chunk_size(m_inputSize - first, wait);
+            if (m_inputCursor.compare_exchange_weak(first, first + count,
+                                                    std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    // Guided self-scheduling: take a share of what is left, so chunks are
+    // large at first and shrink near the end where threads would otherwise
+    // sit idle waiting for the last big chunk
+    std::size_t chunk_size(std::size_t remaining, bool wait) const {
+        std::size_t count = m_batchSize;
+        if (wait) {
+            std::size_t threads = std::max<std::size_t>(concurrency(), 1);
+            count = std::max(count, remaining / (2 * threads));
+            if (m_grainSize)
+                count = std::min(count, std::max(m_grainSize, m_batchSize));
+        }
+        if (m_reorder)
+            count = std::min(count, m_reorder->window());
+        return std::min(count, remaining);
+    }
+
     Func m_func;
     InputIterator m_inputBegin;
     InputIterator m_inputEnd;
     std::mutex m_inputMutex;
-    stream_queue<output_value_type> &m_output;
+    output_queue_type &m_output;
+    const std::size_t m_batchSize;
+    const std::size_t m_grainSize;
+    const std::chrono::microseconds m_batchTimeout;
+    const char *m_name;
+
+    // Random access inputs only
+    std::size_t m_inputSize{0};
+    std::atomic<std::size_t> m_inputCursor{0};
+
+    // Ordered mode only. m_inputIndex is guarded by m_inputMutex.
+    std::optional<reorder_buffer<reorder_value_type>> m_reorder;
+    std::size_t m_inputIndex{0};
+
+    std::atomic<size_t> m_concurrency{1};
+
+    // Pool mode bookkeeping. See make_processor().
+    std::atomic<size_t> m_inFlight{0};
+    std::atomic<bool> m_inputEnded{false};
+    std::atomic<size_t> m_parkedCount{0};
+    std::mutex m_parkedMutex;
+    std::queue<output_value_type> m_parked;
+
+    struct stats_counters {
+        detail::stat_counter<> itemsIn;
+        detail::stat_counter<> itemsOut;
+        detail::stat_counter<> functionNs;
+        detail::stat_counter<> inputWaitNs;
+        detail::stat_counter<> outputWaitNs;
+        detail::stat_distribution<> batchSize;
+        detail::stat_distribution<> batchWaitNs;
+    };
+    stats_counters m_stats;
 };
 
-template <class InputIterator, class Func>
+/**
+ * \brief iterable_processor that owns its output stream_queue
+ *
+ * The OutputBuffer selects the queue's storage. Single threaded stages can use
+ * the lock-free spsc_ring_buffer or mpsc_ring_buffer from ring_buffer.hpp.
+ */
+template <class InputIterator, class Func,
+          class OutputBuffer =
+              locked_buffer<stage_output_t<Func>>>
 class stream_processor
-    : public iterable_processor<InputIterator, Func>,
-      public stream_queue<typename function_traits<Func>::return_type> {
+    : public iterable_processor<InputIterator, Func, OutputBuffer>,
+      public stream_queue<stage_output_t<Func>,
+                          OutputBuffer> {
 public:
-    stream_processor(InputIterator begin, InputIterator end, const Func &func)
-        : iterable_processor<InputIterator, Func>(begin, end, *this, func) {}
+    // The stage's stats, which include its output queue's
+    using iterable_processor<InputIterator, Func, OutputBuffer>::stats;
+
+    stream_processor(InputIterator begin, InputIterator end, Func func,
+                     const stream_options &options = {})
+        : iterable_processor<InputIterator, Func, OutputBuffer>(
+              begin, end, *this, std::move(func), options),
+          stream_queue<stage_output_t<Func>,
+                       OutputBuffer>(options.capacity) {}
 };
 
 /**
@@ -106,7 +755,8 @@ public:
  * Includes a stream_processor that takes input from a given container, using
  * its begin()/end(). Automatically starts threads to do the processing. Uses
  * stream_queue for output, which also supports iteration with begin()/end().
- * Items are produced in the order processing finishes.
+ * Items are produced in the order processing finishes, unless
+ * stream_options::ordered is set.
  *
  * Example:
  * @code
@@ -116,41 +766,81 @@ public:
  *     std::cout << item << std::endl;
  * @endcode
  */
-template <class InputIterator, class Func>
-class parallel_streams : public stream_processor<InputIterator, Func> {
+template <class InputIterator, class Func,
+          class OutputBuffer =
+              locked_buffer<stage_output_t<Func>>>
+class parallel_streams
+    : public stream_processor<InputIterator, Func, OutputBuffer> {
+    using processor_type = stream_processor<InputIterator, Func, OutputBuffer>;
+    using queue_type = typename processor_type::output_queue_type;
+
 public:
     // Constructor with own dedicated threads
-    parallel_streams(InputIterator begin, InputIterator end, const Func &func,
-                     size_t thread_count = std::thread::hardware_concurrency())
-        : stream_processor<InputIterator, Func>(begin, end, func) {
+    parallel_streams(InputIterator begin, InputIterator end, Func func,
+                     size_t thread_count = std::thread::hardware_concurrency(),
+                     const stream_options &options = {})
+        : processor_type(begin, end, std::move(func), options) {
+        this->on_cancel([this] { processor_type::cancel_input(); });
         start(thread_count);
     }
 
-    // Constructor to use a shared thread pool
-    parallel_streams(InputIterator begin, InputIterator end, const Func &func,
-                     thread_pool &threads)
-        : stream_processor<InputIterator, Func>(begin, end, func) {
-        threads.process(
-            stream_processor<InputIterator, Func>::make_processor());
+    // Constructor to use a shared thread pool. If the pool autoscale()s,
+    // the stage gains and loses workers with its pressure().
+    parallel_streams(InputIterator begin, InputIterator end, Func func,
+                     thread_pool &threads, const stream_options &options = {})
+        : processor_type(begin, end, std::move(func), options) {
+        this->on_cancel([this] { processor_type::cancel_input(); });
+        task_scaling scaling;
+        scaling.min_concurrency = options.min_threads;
+        scaling.max_concurrency = options.max_threads;
+        scaling.pressure = [this] { return processor_type::pressure(); };
+        scaling.resized = [this](size_t concurrency) {
+            processor_type::set_concurrency(concurrency);
+        };
+        size_t concurrency = options.max_threads
+                                 ? std::min(options.max_threads, threads.size())
+                                 : threads.size();
+        processor_type::set_concurrency(concurrency);
+        threads.process(processor_type::make_processor(), concurrency,
+                        std::move(scaling));
+        m_pooled = true;
     }
 
+    // Once reading has started, e.g. when breaking out of a loop over the
+    // stage, nothing can read the rest, so the stage and those before it are
+    // cancelled. So is a bounded stage that was never read, e.g. after an
+    // exception skipped the loop, as it would block forever on a full
+    // output. Only an unbounded stage that was never read runs to the end of
+    // its input, for the side effects of its function.
     ~parallel_streams() {
+        if (this->popped_any() || this->bounded())
+            this->cancel();
         for (auto &thread : m_threads)
             thread.join();
+        if (m_pooled)
+            this->wait_closed();
     }
 
-    using stream_queue<typename function_traits<Func>::return_type>::begin;
-    using stream_queue<typename function_traits<Func>::return_type>::end;
+
+    using queue_type::begin;
+    using queue_type::end;
+
+    using processor_type::concurrency;
 
 private:
     void start(size_t thread_count) {
+        processor_type::set_concurrency(thread_count);
         m_threads.reserve(thread_count);
+        // Make every writer before starting any thread, so one thread
+        // finishing early cannot close the output
         for (size_t i = 0; i < thread_count; ++i)
             m_threads.emplace_back(
-                &stream_processor<InputIterator, Func>::process_all,
-                (stream_processor<InputIterator, Func> *)this);
+                [this, writer = this->make_writer()]() mutable {
+                    processor_type::process_all(std::move(writer));
+                });
     }
     std::vector<std::thread> m_threads;
+    bool m_pooled{false};
 };
 
 } // namespace psp
@@ -8,13 +8,23 @@
 #pragma once
 
 #include <assert.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <algorithm>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <mutex>
 #include <optional>
 #include <queue>
 #include <thread>
 #include <type_traits>
+#include <vector>
+
+#include "stats.hpp"
+#include "trace.hpp"
 
 namespace psp {
 
@@ -35,8 +45,12 @@ public:
 
     consuming_queue_iterator(Queue &queue, bool end)
         : m_queue(queue), m_end(end) {}
+    // Copies the position only. A value already read belongs to one
+    // iterator, so is never copied.
     consuming_queue_iterator(const consuming_queue_iterator &other)
-        : m_queue(other.m_queue), m_value{other.m_value}, m_end(other.m_end) {}
+        : m_queue(other.m_queue), m_end(other.m_end) {
+        assert(!other.m_value.has_value());
+    }
     consuming_queue_iterator(consuming_queue_iterator &&other)
         : m_queue(other.m_queue), m_value{std::move(other.m_value)},
           m_end(other.m_end) {
@@ -79,9 +93,13 @@ public:
         m_value.reset();
         return *this;
     }
+    // Returns an iterator holding the current value, moved rather than
+    // copied
     consuming_queue_iterator operator++(int) {
-        consuming_queue_iterator tmp(*this);
-        ++(*this);
+        read();
+        consuming_queue_iterator tmp(m_queue, m_end);
+        tmp.m_value = std::move(m_value);
+        m_value.reset();
         return tmp;
     }
     bool operator==(const consuming_queue_iterator &other) const {
@@ -93,6 +111,78 @@ public:
         return !(*this == other);
     };
 
+    // Consumes up to max items, including any value already read, and writes
+    // them to out. Only waits if there is nothing at all. Returns zero at the
+    // end of the stream.
+    template <class OutputIt> std::size_t pop_n(OutputIt out, std::size_t max) {
+        if (m_end || !max)
+            return 0;
+        if (!m_value.has_value())
+            return m_queue.pop_n(out, max);
+        *out++ = std::move(*m_value);
+        m_value.reset();
+        return 1 + m_queue.try_pop_n(out, max - 1);
+    }
+
+    // See stream_queue::pop_n_until()
+    template <class OutputIt, class Clock, class Duration>
+    std::size_t
+    pop_n_until(OutputIt out, std::size_t max,
+                const std::chrono::time_point<Clock, Duration> &deadline) {
+        if (m_end || !max)
+            return 0;
+        if (!m_value.has_value())
+            return m_queue.pop_n_until(out, max, deadline);
+        *out++ = std::move(*m_value);
+        m_value.reset();
+        return 1 + m_queue.pop_n_until(out, max - 1, deadline);
+    }
+
+    // Like pop_n() but never waits. Returns zero when nothing is available
+    // yet, which is only the end of the stream once ended() is true.
+    template <class OutputIt>
+    std::size_t try_pop_n(OutputIt out, std::size_t max) {
+        if (m_end || !max)
+            return 0;
+        if (!m_value.has_value())
+            return m_queue.try_pop_n(out, max);
+        *out++ = std::move(*m_value);
+        m_value.reset();
+        return 1 + m_queue.try_pop_n(out, max - 1);
+    }
+
+    std::optional<value_type> try_pop() {
+        if (m_end)
+            return {};
+        if (!m_value.has_value())
+            return m_queue.try_pop();
+        std::optional<value_type> result = std::move(m_value);
+        m_value.reset();
+        return result;
+    }
+
+    // Items waiting in the queue, including any value already read
+    std::size_t size() const {
+        return m_queue.size() + (m_value.has_value() ? 1 : 0);
+    }
+    std::size_t capacity() const { return m_queue.capacity(); }
+
+    // True if nothing more will ever be read, without waiting
+    bool ended() const {
+        return m_end || (!m_value.has_value() && m_queue.finished());
+    }
+
+    // See stream_queue::notify_when_ready()
+    template <class Callback> bool notify_when_ready(Callback &&callback) {
+        if (m_end || m_value.has_value())
+            return false;
+        return m_queue.notify_when_ready(std::forward<Callback>(callback));
+    }
+
+    // See stream_queue::cancel(). Only touches the queue, so is safe to call
+    // while another thread reads through the iterator.
+    void cancel() const { m_queue.cancel(); }
+
 private:
     void read() const {
         if (!m_end && !m_value.has_value())
@@ -103,10 +193,164 @@ private:
     bool m_end;
 };
 
-template <class T> class stream_queue {
+/**
+ * @brief A lazy input iterator for a queue that pops items in batches
+ *
+ * Holds up to batchSize items at a time, so the queue's synchronization is
+ * paid once per batch rather than once per item. Expects the queue to have a
+ * pop_n() method.
+ */
+template <class Queue> class batched_queue_iterator {
+public:
+    using iterator_category = std::input_iterator_tag;
+    using difference_type = std::size_t;
+    using value_type = typename Queue::value_type;
+    using pointer = value_type *;
+    using const_pointer = const value_type *;
+    using reference = value_type &;
+    using const_reference = const value_type &;
+
+    batched_queue_iterator(Queue &queue, std::size_t batchSize, bool end)
+        : m_queue(queue), m_batchSize(batchSize ? batchSize : 1), m_end(end) {}
+
+    const_reference operator*() const {
+        read();
+        return m_batch.at(m_position);
+    }
+    reference operator*() {
+        read();
+        return m_batch.at(m_position);
+    }
+    const_pointer operator->() const { return &**this; }
+    pointer operator->() { return &**this; }
+    batched_queue_iterator &operator++() {
+        // Consume the value in case of iterating without reading
+        read();
+        ++m_position;
+        return *this;
+    }
+    bool operator==(const batched_queue_iterator &other) const {
+        read();
+        other.read();
+        return has_value() == other.has_value();
+    };
+    bool operator!=(const batched_queue_iterator &other) const {
+        return !(*this == other);
+    };
+
+private:
+    bool has_value() const { return m_position < m_batch.size(); }
+    void read() const {
+        if (!m_end && !has_value()) {
+            m_batch.clear();
+            m_position = 0;
+            m_queue.pop_n(std::back_inserter(m_batch), m_batchSize);
+        }
+    }
+    Queue &m_queue;
+    mutable std::vector<value_type> m_batch;
+    mutable std::size_t m_position{0};
+    std::size_t m_batchSize;
+    bool m_end;
+};
+
+// Pair of iterators for use in range-based for loops
+template <class Iterator> class iterator_range {
+public:
+    iterator_range(Iterator begin, Iterator end)
+        : m_begin(std::move(begin)), m_end(std::move(end)) {}
+    Iterator begin() const { return m_begin; }
+    Iterator end() const { return m_end; }
+
+private:
+    Iterator m_begin;
+    Iterator m_end;
+};
+
+/**
+ * @brief Default stream_queue storage: a std::queue behind a mutex
+ *
+ * Unbounded unless given a capacity. A Buffer must provide try_push(),
+ * try_pop() returning an std::optional<value_type>, size() and capacity().
+ * try_push() must leave the value untouched when it returns false. The batch
+ * versions, try_push_range() and try_pop_n(), move as many items as fit or
+ * are available and return the first item not pushed or the number popped.
+ */
+template <class T> class locked_buffer {
+public:
+    using value_type = T;
+
+    // A capacity of zero means unbounded
+    explicit locked_buffer(std::size_t capacity = 0)
+        : m_capacity(capacity ? capacity
+                              : std::numeric_limits<std::size_t>::max()) {}
+
+    template <class V> bool try_push(V &&value) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_queue.size() >= m_capacity)
+            return false;
+        m_queue.push(std::forward<V>(value));
+        return true;
+    }
+
+    template <class InputIt> InputIt try_push_range(InputIt first, InputIt last) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for (; first != last && m_queue.size() < m_capacity; ++first)
+            m_queue.push(*first);
+        return first;
+    }
+
+    std::optional<value_type> try_pop() {
+        std::optional<value_type> result;
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (!m_queue.empty()) {
+            result = std::move(m_queue.front());
+            m_queue.pop();
+        }
+        return result;
+    }
+
+    template <class OutputIt>
+    std::size_t try_pop_n(OutputIt out, std::size_t max) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        std::size_t count = std::min(max, m_queue.size());
+        for (std::size_t i = 0; i < count; ++i) {
+            *out++ = std::move(m_queue.front());
+            m_queue.pop();
+        }
+        return count;
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_queue.size();
+    }
+
+    std::size_t capacity() const { return m_capacity; }
+
+private:
+    const std::size_t m_capacity;
+    mutable std::mutex m_mutex;
+    std::queue<value_type> m_queue;
+};
+
+/**
+ * @brief Multi-producer multi-consumer queue where readers block until either
+ * an item is available or all writers have been destroyed.
+ *
+ * Storage is provided by the Buffer, e.g. locked_buffer or one of the lock-free
+ * ring buffers in ring_buffer.hpp. Threads only sleep on the condition
+ * variables when the buffer is empty (or full, for pushes to a bounded buffer),
+ * and pushes/pops only take m_mutex to notify when someone is actually
+ * sleeping. Instead of sleeping, thread_pool tasks register a callback with
+ * notify_when_ready() or writer::notify_when_space().
+ */
+template <class T, class Buffer = locked_buffer<T>> class stream_queue {
 public:
     using value_type = T;
+    using buffer_type = Buffer;
     using iterator = consuming_queue_iterator<stream_queue>;
+    using batched_iterator = batched_queue_iterator<stream_queue>;
 
     /**
      * @brief Sharable writer reference to make readers block until the writer
@@ -114,6 +358,8 @@ public:
      */
     class writer {
     public:
+        using value_type = T;
+
         writer(stream_queue &queue) : m_queue(&queue) {
             m_queue->writer_open();
         }
@@ -135,77 +381,469 @@ public:
 
         writer &operator=(const writer &other) = delete;
 
+        // Blocks while a bounded queue is full
         template <class V> void push(V &&value) {
             m_queue->push(std::forward<V>(value));
         }
 
+        // Returns false without touching value if the queue is full
+        template <class V> bool try_push(V &&value) {
+            return m_queue->try_push(std::forward<V>(value));
+        }
+
+        // Pushes all items with one notification per batch. Items are
+        // copied unless given move iterators. Blocks while a bounded queue is
+        // full.
+        template <class InputIt> void push_range(InputIt first, InputIt last) {
+            m_queue->push_range(first, last);
+        }
+
+        // Pushes items until the queue is full. Returns the first item not
+        // pushed.
+        template <class InputIt>
+        InputIt try_push_range(InputIt first, InputIt last) {
+            return m_queue->try_push_range(first, last);
+        }
+
+        // Like stream_queue::notify_when_ready(), but for space to push
+        bool notify_when_space(std::function<void()> callback) {
+            return m_queue->notify_when_space(std::move(callback));
+        }
+
+        // True once the queue has been cancelled and pushes are dropped, so
+        // a producer can stop early
+        bool cancelled() const { return m_queue->cancelled(); }
+
     private:
         stream_queue *m_queue;
     };
 
+    stream_queue() = default;
+
+    // Bounds the number of queued items, after which writers wait in push().
+    // Zero selects the Buffer's default.
+    explicit stream_queue(std::size_t capacity) : m_buffer(capacity) {}
+
     std::optional<value_type> pop() {
-        std::optional<value_type> result;
-        std::unique_lock<std::mutex> lk(m_mutex);
-        m_cond.wait(lk, [&] { return !m_writers || !m_queue.empty(); });
-        if (!m_queue.empty()) {
-            result = std::move(m_queue.front());
-            m_queue.pop();
-        } else
-            assert(!m_writers);
+        for (;;) {
+            std::optional<value_type> result = try_pop();
+            if (result)
+                return result;
+            // Pushes happen before the last writer_close(), so seeing no
+            // writers means one more try_pop() is final
+            if (stopped())
+                return try_pop();
+            wait_until(m_notEmpty, [&] { return readable(); });
+        }
+    }
+
+    // Pops up to max items into out, waiting only if there are none. Returns
+    // zero at the end of the stream.
+    template <class OutputIt> std::size_t pop_n(OutputIt out, std::size_t max) {
+        for (;;) {
+            std::size_t count = try_pop_n(out, max);
+            if (count || !max)
+                return count;
+            if (stopped())
+                return try_pop_n(out, max);
+            wait_until(m_notEmpty, [&] { return readable(); });
+        }
+    }
+
+    std::optional<value_type> try_pop() {
+        if (cancelled())
+            return {};
+        std::optional<value_type> result = m_buffer.try_pop();
+        if (result) {
+            mark_popped();
+            m_stats.popped.add(1);
+            trace_size();
+            notify_waiting(m_notFull);
+        }
         return result;
     }
 
-    std::size_t size() const {
-        std::lock_guard<std::mutex> lk(m_mutex);
-        return m_queue.size();
+    // Pops items into out as they arrive until there are max, the deadline
+    // passes or the stream ends. Unlike pop_n(), this keeps waiting after the
+    // first item, trading latency for larger batches.
+    template <class OutputIt, class Clock, class Duration>
+    std::size_t
+    pop_n_until(OutputIt out, std::size_t max,
+                const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::size_t total = 0;
+        for (;;) {
+            std::size_t count = try_pop_n(out, max - total);
+            total += count;
+            for (; count; --count)
+                ++out;
+            if (total == max)
+                return total;
+            if (stopped())
+                return total + try_pop_n(out, max - total);
+            if (!wait_until(m_notEmpty, [&] { return readable(); }, deadline))
+                return total;
+        }
+    }
+
+    // Pops up to max items into out without waiting
+    template <class OutputIt>
+    std::size_t try_pop_n(OutputIt out, std::size_t max) {
+        if (cancelled())
+            return 0;
+        std::size_t count = m_buffer.try_pop_n(out, max);
+        if (count) {
+            mark_popped();
+            m_stats.popped.add(count);
+            trace_size();
+            notify_waiting(m_notFull, count > 1);
+        }
+        return count;
+    }
+
+    // Calls callback once, from the next push or when the last writer
+    // closes, e.g. to wake a thread_pool task that found the queue empty.
+    // Returns false without registering if an item is already available or
+    // the stream has ended, in which case the caller should just try again.
+    bool notify_when_ready(std::function<void()> callback) {
+        return add_callback(m_notEmpty, std::move(callback),
+                            [&] { return readable(); });
+    }
+
+    // True once all writers have closed and every item has been popped, or
+    // the queue was cancelled
+    bool finished() {
+        return cancelled() || (closed() && !m_buffer.size());
+    }
+
+    /**
+     * @brief Stops the stream early, e.g. when a reader has found what it
+     * needs
+     *
+     * Pops then return nothing, as if the stream had ended, and pushes drop
+     * their items rather than waiting for space. Sleeping readers and writers
+     * are woken, as are thread_pool tasks waiting on the queue, and then each
+     * on_cancel() callback is called once. Stages writing to the queue stop
+     * claiming input and cancel their own input queues in turn, so cancelling
+     * the last queue of a pipeline stops every stage. Items already queued
+     * are freed with the queue.
+     */
+    void cancel() {
+        if (m_cancelled.exchange(true))
+            return;
+        std::vector<std::function<void()>> readyCallbacks;
+        std::vector<std::function<void()>> spaceCallbacks;
+        std::vector<std::function<void()>> cancelCallbacks;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_notEmpty.cond.notify_all();
+            m_notFull.cond.notify_all();
+            take_callbacks(m_notEmpty, readyCallbacks);
+            take_callbacks(m_notFull, spaceCallbacks);
+            std::swap(cancelCallbacks, m_cancelCallbacks);
+        }
+        for (auto *callbacks :
+             {&readyCallbacks, &spaceCallbacks, &cancelCallbacks})
+            for (auto &callback : *callbacks)
+                callback();
+    }
+
+    bool cancelled() const {
+        return m_cancelled.load(std::memory_order_relaxed);
+    }
+
+    // Calls callback from cancel(), or immediately if the queue has already
+    // been cancelled. Must stay valid for the life of the queue.
+    void on_cancel(std::function<void()> callback) {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (!m_cancelled.load()) {
+                m_cancelCallbacks.push_back(std::move(callback));
+                return;
+            }
+        }
+        callback();
+    }
+
+    // True once any item has been popped, i.e. someone has started reading
+    bool popped_any() const {
+        return m_poppedAny.load(std::memory_order_relaxed);
+    }
+
+    // Blocks until every writer has closed, e.g. before freeing a queue that
+    // thread_pool tasks push to
+    void wait_closed() {
+        wait_until(m_notEmpty, [&] { return !m_writers.load(); });
+        closed();
+    }
+
+    std::size_t size() const { return m_buffer.size(); }
+
+    // Counters so far, while the queue is in use. All zero unless
+    // PSP_ENABLE_STATS is set.
+    queue_stats stats() const {
+        queue_stats result;
+        result.pushed = m_stats.pushed.load();
+        result.popped = m_stats.popped.load();
+        result.high_water = m_stats.highWater.load();
+        result.push_wait_ns = m_notFull.waitNs.load();
+        result.pop_wait_ns = m_notEmpty.waitNs.load();
+        return result;
+    }
+
+    std::size_t capacity() const { return m_buffer.capacity(); }
+
+    // True if writers can block on a full queue
+    bool bounded() const {
+        return capacity() != std::numeric_limits<std::size_t>::max();
     }
 
     iterator begin() { return iterator(*this, false); }
     iterator end() { return iterator(*this, true); }
 
+    // Iterate while popping up to batch_size items at a time
+    iterator_range<batched_iterator> drain(std::size_t batch_size) {
+        return {batched_iterator(*this, batch_size, false),
+                batched_iterator(*this, batch_size, true)};
+    }
+
     writer make_writer() {
         auto result = writer(*this);
-        if (!m_hasFirstWriter) {
+        if (!m_hasFirstWriter.exchange(true)) {
             // Remove the internal refcount so that readers will be notified
             // when the last writer is deleted.
             writer_close();
-            m_hasFirstWriter = true;
         }
         return result;
     }
 
 private:
     // Only accessible to writers
-    void writer_open() {
-        std::lock_guard<std::mutex> lk(m_mutex);
-        ++m_writers;
-    }
+    void writer_open() { m_writers.fetch_add(1); }
 
     // Only accessible to writers
     void writer_close() {
+        std::vector<std::function<void()>> callbacks;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            assert(m_writers.load() > 0);
+            if (--m_writers == 0) {
+                m_notEmpty.cond.notify_all();
+                take_callbacks(m_notEmpty, callbacks);
+            }
+        }
+
+        // The reader may destroy the queue as soon as m_mutex is released, so
+        // only touch the local copy
+        for (auto &callback : callbacks)
+            callback();
+    }
+
+    // True once the last writer has closed. Takes m_mutex so the last
+    // writer_close() has completely finished and the reader is free to destroy
+    // the queue.
+    bool closed() {
+        if (m_writers.load())
+            return false;
         std::lock_guard<std::mutex> lk(m_mutex);
-        assert(m_writers > 0);
-        if (--m_writers == 0)
-            m_cond.notify_all();
+        return true;
     }
 
-    // Only accessible to writers
+    // True once the stream cannot produce more than the buffer holds
+    bool stopped() { return cancelled() || closed(); }
+
+    // Wait conditions for readers and writers. Cancelling satisfies both.
+    bool readable() const {
+        return m_buffer.size() || !m_writers.load() || cancelled();
+    }
+    bool writable() const {
+        return m_buffer.size() < m_buffer.capacity() || cancelled();
+    }
+
+    void mark_popped() {
+        if (!m_poppedAny.load(std::memory_order_relaxed))
+            m_poppedAny.store(true, std::memory_order_relaxed);
+    }
+
+    // Only accessible to writers. Pushes to a cancelled queue are dropped.
     template <class V> void push(V &&value) {
+        if (cancelled())
+            return;
+        // try_push() only consumes the value when it succeeds
+        while (!m_buffer.try_push(std::forward<V>(value))) {
+            if (cancelled())
+                return;
+            wait_until(m_notFull, [&] { return writable(); });
+        }
+        record_pushed(1);
+        notify_waiting(m_notEmpty);
+    }
+
+    // Only accessible to writers
+    template <class V> bool try_push(V &&value) {
+        if (cancelled())
+            return true;
+        if (!m_buffer.try_push(std::forward<V>(value)))
+            return cancelled();
+        record_pushed(1);
+        notify_waiting(m_notEmpty);
+        return true;
+    }
+
+    // Only accessible to writers
+    template <class InputIt> void push_range(InputIt first, InputIt last) {
+        while (first != last) {
+            InputIt next = try_push_range(first, last);
+            if (next == first)
+                wait_until(m_notFull, [&] { return writable(); });
+            first = next;
+        }
+    }
+
+    // Only accessible to writers
+    template <class InputIt>
+    InputIt try_push_range(InputIt first, InputIt last) {
+        if (cancelled())
+            return last;
+        InputIt next = m_buffer.try_push_range(first, last);
+        if (next != first) {
+            if constexpr (stats_enabled || trace_enabled)
+                record_pushed(std::size_t(std::distance(first, next)));
+            notify_waiting(m_notEmpty, true);
+        }
+        return next;
+    }
+
+    // Only accessible to writers
+    bool notify_when_space(std::function<void()> callback) {
+        return add_callback(m_notFull, std::move(callback),
+                            [&] { return writable(); });
+    }
+
+    // Threads sleeping until a condition may hold, plus one shot callbacks
+    // to run when it does. All but the count are guarded by m_mutex.
+    struct waiters {
+        std::condition_variable cond;
+        std::atomic<uint32_t> count{0};
+        std::vector<std::function<void()>> callbacks;
+        detail::stat_counter<> waitNs;
+    };
+
+    struct stats_counters {
+        detail::stat_counter<> pushed;
+        detail::stat_counter<> popped;
+        detail::stat_counter<> highWater;
+    };
+
+    // The depth is approximate as the counters are not updated atomically
+    // with the buffer
+    void record_pushed(std::size_t count) {
+        trace_size();
+        m_stats.pushed.add(count);
+        if constexpr (stats_enabled) {
+            std::uint64_t pushed = m_stats.pushed.load();
+            std::uint64_t popped = m_stats.popped.load();
+            if (pushed > popped)
+                m_stats.highWater.max(pushed - popped);
+        }
+    }
+
+    void trace_size() {
+        detail::trace_counter("queue size", this,
+                              [this] { return m_buffer.size(); });
+    }
+
+    // Sleep until ready() holds. The waiting count is raised before ready()
+    // is checked so a concurrent notify_waiting() cannot miss us.
+    template <class Pred> void wait_until(waiters &w, Pred ready) {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        w.count.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            detail::stat_timer<> timer(w.waitNs);
+            detail::trace_scope<> scope(
+                &w == &m_notFull ? "push wait" : "pop wait", this);
+            w.cond.wait(lk, ready);
+        }
+        w.count.fetch_sub(1);
+    }
+
+    // Timed wait_until(). Returns ready() once woken, so false on timeout.
+    template <class Pred, class Clock, class Duration>
+    bool wait_until(waiters &w, Pred ready,
+                    const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        w.count.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool result;
+        {
+            detail::stat_timer<> timer(w.waitNs);
+            detail::trace_scope<> scope(
+                &w == &m_notFull ? "push wait" : "pop wait", this);
+            result = w.cond.wait_until(lk, deadline, ready);
+        }
+        w.count.fetch_sub(1);
+        return result;
+    }
+
+    // Non-blocking version of wait_until(). Returns false, without adding the
+    // callback, if ready() already holds.
+    template <class Pred>
+    bool add_callback(waiters &w, std::function<void()> &&callback,
+                      Pred ready) {
         std::lock_guard<std::mutex> lk(m_mutex);
-        m_queue.push(std::forward<V>(value));
-        m_cond.notify_all();
+        w.count.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) {
+            w.count.fetch_sub(1);
+            return false;
+        }
+        w.callbacks.push_back(std::move(callback));
+        return true;
     }
 
-    std::condition_variable m_cond;
-    mutable std::mutex m_mutex;
-    std::queue<value_type> m_queue;
+    // Wakes one waiting thread, or all of them after a batch, and runs all
+    // callbacks
+    void notify_waiting(waiters &w, bool all = false) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!w.count.load(std::memory_order_relaxed))
+            return;
+        std::vector<std::function<void()>> callbacks;
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (all)
+                w.cond.notify_all();
+            else
+                w.cond.notify_one();
+            take_callbacks(w, callbacks);
+        }
+        for (auto &callback : callbacks)
+            callback();
+    }
+
+    // Call with m_mutex held
+    void take_callbacks(waiters &w,
+                        std::vector<std::function<void()>> &callbacks) {
+        std::swap(callbacks, w.callbacks);
+        w.count.fetch_sub(static_cast<uint32_t>(callbacks.size()));
+    }
+
+    Buffer m_buffer;
+    std::mutex m_mutex;
+    waiters m_notEmpty;
+    waiters m_notFull;
+    stats_counters m_stats;
+
+    // Set once by cancel(). m_cancelCallbacks is guarded by m_mutex.
+    std::atomic<bool> m_cancelled{false};
+    std::vector<std::function<void()>> m_cancelCallbacks;
+    std::atomic<bool> m_poppedAny{false};
 
     // Refcount the number of writers, so the readers know when the stream has
     // finished. The alternative would be to promise a number of items that will
     // be written. Initialize with a single refcount to force readers to wait
     // for at least one writer.
-    uint32_t m_writers{1};
-    bool m_hasFirstWriter{false};
+    std::atomic<uint32_t> m_writers{1};
+    std::atomic<bool> m_hasFirstWriter{false};
 };
 
 } // namespace psp
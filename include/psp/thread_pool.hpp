@@ -7,107 +7,565 @@
 
 #pragma once
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <functional>
-#include <list>
+#include <deque>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ring_buffer.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "unique_function.hpp"
 
 namespace psp {
 
+// Result of a call to a thread_pool multitask
+enum class task_status {
+    // Call again
+    ready,
+
+    // Nothing to do until the task's waker is called. See
+    // thread_pool::current_waker().
+    waiting,
+
+    // Retire the task
+    finished,
+};
+
+/**
+ * @brief Limits and load signal for a multitask that thread_pool::autoscale()
+ * may resize
+ *
+ * pressure() is called periodically from the autoscaling thread and should
+ * return how far the task is falling behind, e.g. how full its input queue
+ * is less how full its output queue is. Workers are moved from the task with
+ * the least pressure to the one with the most.
+ */
+struct task_scaling {
+    size_t min_concurrency{1};
+
+    // Zero means the pool size
+    size_t max_concurrency{0};
+
+    unique_function<double()> pressure;
+
+    // Optional. Called with the new concurrency whenever it changes.
+    unique_function<void(size_t)> resized;
+};
+
+/**
+ * @brief Threads that repeatedly call multitasks until they finish
+ *
+ * Each worker has its own deque of task handles and calls them round robin,
+ * so dispatching a call only touches the worker's own lock. process() gives
+ * every worker a handle to the new task so all threads can work on it at
+ * once. A worker that runs out of handles steals from the front of another
+ * worker's deque, and only sleeps when there are none left anywhere.
+ *
+ * A call returning task_status::waiting sets its handle aside until the task's
+ * waker is called, e.g. by a stream_queue when an item arrives, so workers
+ * are not spent on tasks that have nothing to do. When a call returns
+ * task_status::finished the task is retired: its remaining handles are
+ * removed from every deque and it is destroyed once the last running call
+ * returns.
+ */
 class thread_pool {
+    struct task;
+
 public:
-    using multitask = std::function<bool()>;
+    // Move-only, so tasks may own move-only state
+    using multitask = unique_function<task_status()>;
 
-    thread_pool(size_t count = std::thread::hardware_concurrency()) {
-        // All threads start from the beginning of the queue and do one pass
-        // through it
+    /**
+     * @brief Reschedules a task that returned task_status::waiting
+     *
+     * Safe to call from any thread, any number of times, and after the task
+     * has finished. A wake that arrives while no handle is waiting is
+     * remembered, so the next call to return waiting is rescheduled
+     * immediately rather than missing it. Must not be called after the pool
+     * is destroyed.
+     */
+    class waker {
+    public:
+        waker() = default;
+        void operator()() const {
+            if (auto handle = m_task.lock())
+                m_pool->wake(handle);
+        }
+        explicit operator bool() const { return m_pool != nullptr; }
+
+    private:
+        friend class thread_pool;
+        waker(thread_pool *pool, std::weak_ptr<task> task)
+            : m_pool(pool), m_task(std::move(task)) {}
+        thread_pool *m_pool{nullptr};
+        std::weak_ptr<task> m_task;
+    };
 
+    thread_pool(size_t count = std::thread::hardware_concurrency()) {
         for (size_t i = 0; i < count; ++i)
-            m_threads.emplace_back(&thread_pool::entrypoint, this,
-                                   m_multitasks.begin());
+            m_workers.push_back(std::make_unique<worker>());
+        for (size_t i = 0; i < count; ++i)
+            m_threads.emplace_back(&thread_pool::entrypoint, this, i);
     }
     ~thread_pool() {
         {
-            std::lock_guard<std::mutex> lk(m_multitasksMutex);
+            std::lock_guard<std::mutex> lk(m_sleepMutex);
             m_running = false;
-            m_multitasksCond.notify_all();
+            m_sleepCond.notify_all();
+            m_autoscaleCond.notify_all();
         }
+        if (m_autoscaler.joinable())
+            m_autoscaler.join();
         for (auto &thread : m_threads)
             thread.join();
+
+        // Unfinished tasks may wake each other as they are destroyed, e.g. by
+        // closing a queue, so stop wakes reaching the pool first
+        for (auto &handle : m_tasks)
+            handle->alive = false;
+        for (auto &w : m_workers)
+            w->handles.clear();
+        m_tasks.clear();
+    }
+
+    // Adds a multitask. Functions returning bool rather than task_status are
+    // called until they return false. At most concurrency workers are given
+    // a handle, and so may call it at once. Zero means all of them.
+    template <class Func> void process(Func &&func, size_t concurrency = 0) {
+        process(std::forward<Func>(func), concurrency, task_scaling{});
+    }
+
+    // Adds a multitask that autoscale() may give more or fewer workers,
+    // between the scaling limits, starting with concurrency
+    template <class Func>
+    void process(Func &&func, size_t concurrency, task_scaling scaling) {
+        task_handle handle;
+        if constexpr (std::is_same_v<std::invoke_result_t<Func &>, bool>)
+            handle = std::make_shared<task>(
+                [func = std::forward<Func>(func)]() mutable {
+                    return func() ? task_status::ready : task_status::finished;
+                });
+        else
+            handle = std::make_shared<task>(std::forward<Func>(func));
+        if (!concurrency || concurrency > m_workers.size())
+            concurrency = m_workers.size();
+        if (scaling.pressure) {
+            if (!scaling.max_concurrency ||
+                scaling.max_concurrency > m_workers.size())
+                scaling.max_concurrency = m_workers.size();
+            scaling.min_concurrency = std::clamp<size_t>(
+                scaling.min_concurrency, 1, scaling.max_concurrency);
+            concurrency = std::clamp(concurrency, scaling.min_concurrency,
+                                     scaling.max_concurrency);
+            handle->scaling = std::move(scaling);
+        }
+        handle->concurrency = concurrency;
+        {
+            std::lock_guard<std::mutex> lk(m_tasksMutex);
+            m_tasks.push_back(handle);
+        }
+        for (size_t i = 0; i < concurrency; ++i)
+            add_handle(handle);
+        std::lock_guard<std::mutex> lk(m_sleepMutex);
+        m_sleepCond.notify_all();
     }
 
-    template <class Func> void process(Func &&func) {
-        std::lock_guard<std::mutex> lk(m_multitasksMutex);
-        m_tasksAlive++;
-        m_multitasks.emplace_back(func);
-        m_multitasksCond.notify_all();
+    // Starts a thread that rebalances workers between tasks given a
+    // task_scaling every interval. Each time, the task with the most
+    // pressure gains a handle, and so a worker's share of calls, if it is
+    // below its maximum. If every worker is already spoken for, the task
+    // with the least pressure gives one up, down to its minimum.
+    void autoscale(std::chrono::microseconds interval =
+                       std::chrono::milliseconds(10)) {
+        if (m_autoscaler.joinable())
+            return;
+        m_autoscaler = std::thread([this, interval] {
+            std::unique_lock<std::mutex> lk(m_sleepMutex);
+            while (!m_autoscaleCond.wait_for(lk, interval,
+                                             [this] { return !m_running; })) {
+                lk.unlock();
+                rebalance();
+                lk.lock();
+            }
+        });
+    }
+
+    size_t size() const { return m_threads.size(); }
+
+    // Per worker counters so far, while the pool is running. All zero unless
+    // PSP_ENABLE_STATS is set.
+    std::vector<worker_stats> stats() const {
+        std::vector<worker_stats> result;
+        for (auto &w : m_workers) {
+            worker_stats ws;
+            ws.calls = w->calls.load();
+            ws.busy_ns = w->busyNs.load();
+            ws.idle_ns = w->idleNs.load();
+            result.push_back(ws);
+        }
+        return result;
+    }
+
+    // Returns a waker for the multitask being called on this thread, or an
+    // empty waker if the calling thread is not running one
+    static waker current_waker() {
+        if (!t_current.pool)
+            return {};
+        return waker(t_current.pool, t_current.running->weak_from_this());
     }
 
 private:
-    struct Task {
-        std::shared_ptr<multitask> func;
-        bool alive{true};
-        Task() {}
+    struct task : std::enable_shared_from_this<task> {
         template <class Func>
-        Task(Func &&func) : func(std::make_shared<multitask>(func)) {}
+        task(Func &&func) : func(std::forward<Func>(func)) {}
+        multitask func;
+        std::atomic<bool> alive{true};
+
+        // Autoscaled tasks only. scalingMutex keeps the task alive while the
+        // autoscale() thread calls its scaling callbacks.
+        std::optional<task_scaling> scaling;
+        std::mutex scalingMutex;
+        std::atomic<size_t> concurrency{0};
+
+        // Handles to drop when their current call returns, after the task
+        // was scaled down
+        std::atomic<size_t> excess{0};
+
+        // Workers whose handles are waiting for a wake, and whether a wake
+        // arrived with none waiting. Guarded by mutex.
+        std::mutex mutex;
+        std::vector<size_t> waiting;
+        bool woken{false};
     };
+    using task_handle = std::shared_ptr<task>;
 
-    void entrypoint(std::list<Task>::iterator iterator) {
-        bool first = true;
-        bool taskDone = false;
-        Task task;
-        for (;;) {
+    // Aligned so workers popping and stealing from different deques do not
+    // contend for a cache line
+    struct alignas(cache_line_size) worker {
+        // Sets queued after changing handles, with mutex held
+        void update_queued() {
+            queued.store(handles.size(), std::memory_order_relaxed);
+        }
+
+        std::mutex mutex;
+        std::deque<task_handle> handles;
+
+        // The size of handles, read by sleep() without locking mutex
+        std::atomic<size_t> queued{0};
+        detail::stat_counter<> calls;
+        detail::stat_counter<> busyNs;
+        detail::stat_counter<> idleNs;
+    };
+
+    // The multitask being called by this thread, for current_waker().
+    // Zero initialized, as a thread_local.
+    struct current_task {
+        thread_pool *pool;
+        task *running;
+    };
+    static inline thread_local current_task t_current;
+
+    void entrypoint(size_t index) {
+        detail::trace_thread_name("psp worker");
+        while (m_running.load(std::memory_order_relaxed)) {
+            task_handle handle = pop(index);
+            if (!handle)
+                handle = steal(index);
+            if (!handle) {
+                sleep(index);
+                continue;
+            }
+            if (!handle->alive.load())
+                continue;
+            t_current = {this, handle.get()};
+            task_status status;
             {
-                std::unique_lock<std::mutex> lk(m_multitasksMutex);
-                if (!first) {
-                    if (taskDone && iterator->alive) {
-                        iterator->alive = false;
-                        --m_tasksAlive;
-                    }
-                    if (!iterator->alive && task.func.use_count() == 2) {
-                        // The last user of finished tasks removes it.
-                        // There "thould" (*hopes even harder*) be no dangling
-                        // iterators
-                        m_multitasks.erase(iterator++);
-                    } else {
-                        iterator++;
-                    }
+                detail::stat_timer<> timer(m_workers[index]->busyNs);
+                detail::trace_scope<> scope("task", handle.get());
+                status = handle->func();
+            }
+            m_workers[index]->calls.add(1);
+            t_current = {};
+            if (status != task_status::finished && take_excess(*handle))
+                continue;
+            switch (status) {
+            case task_status::ready:
+                push(index, std::move(handle));
+                break;
+            case task_status::waiting:
+                wait(index, std::move(handle));
+                break;
+            case task_status::finished:
+                retire(handle);
+                break;
+            }
+        }
+    }
+
+    task_handle pop(size_t index) {
+        worker &w = *m_workers[index];
+        std::lock_guard<std::mutex> lk(w.mutex);
+        if (w.handles.empty())
+            return {};
+        task_handle result = std::move(w.handles.front());
+        w.handles.pop_front();
+        w.update_queued();
+        return result;
+    }
+
+    task_handle steal(size_t index) {
+        for (size_t i = 1; i < m_workers.size(); ++i) {
+            worker &w = *m_workers[(index + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lk(w.mutex);
+            if (!w.handles.empty()) {
+                task_handle result = std::move(w.handles.front());
+                w.handles.pop_front();
+                w.update_queued();
+                return result;
+            }
+        }
+        return {};
+    }
+
+    // Returns the handle to the back of the worker's deque, after its other
+    // tasks
+    void push(size_t index, task_handle &&handle) {
+        worker &w = *m_workers[index];
+        bool spare;
+        {
+            std::lock_guard<std::mutex> lk(w.mutex);
+            w.handles.push_back(std::move(handle));
+            spare = w.handles.size() > 1;
+            w.update_queued();
+        }
+
+        // Only wake a sleeper if there is more here than this worker can run
+        // at once
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (spare && m_sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lk(m_sleepMutex);
+            m_sleepCond.notify_one();
+        }
+    }
+
+    // Sets the handle aside until the task is woken, or requeues it if a
+    // wake already arrived
+    void wait(size_t index, task_handle &&handle) {
+        {
+            std::lock_guard<std::mutex> lk(handle->mutex);
+            if (!handle->woken) {
+                // m_tasks keeps the task alive
+                handle->waiting.push_back(index);
+                return;
+            }
+            handle->woken = false;
+        }
+        push(index, std::move(handle));
+    }
+
+    void wake(const task_handle &handle) {
+        std::vector<size_t> workers;
+        {
+            std::lock_guard<std::mutex> lk(handle->mutex);
+            if (!handle->alive.load())
+                return;
+            if (handle->waiting.empty()) {
+                handle->woken = true;
+                return;
+            }
+            std::swap(workers, handle->waiting);
+        }
+        for (size_t index : workers) {
+            worker &w = *m_workers[index];
+            std::lock_guard<std::mutex> lk(w.mutex);
+            w.handles.push_back(handle);
+            w.update_queued();
+        }
+
+        // The workers the handles went back to may be asleep, but any worker
+        // can steal them
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lk(m_sleepMutex);
+            for (size_t i = 0; i < workers.size(); ++i)
+                m_sleepCond.notify_one();
+        }
+    }
+
+    void retire(const task_handle &handle) {
+        {
+            // Waits for any scaling callback to return, as the task's owner
+            // may be destroyed once it is retired
+            std::lock_guard<std::mutex> lk(handle->scalingMutex);
+            if (!handle->alive.exchange(false))
+                return;
+        }
+
+        // Release the handles after unlocking, in case it destroys the task
+        std::vector<task_handle> removed;
+        for (auto &w : m_workers) {
+            std::lock_guard<std::mutex> lk(w->mutex);
+            for (auto it = w->handles.begin(); it != w->handles.end();) {
+                if (*it == handle) {
+                    removed.push_back(std::move(*it));
+                    it = w->handles.erase(it);
                 } else {
-                    first = false;
+                    ++it;
                 }
+            }
+            w->update_queued();
+        }
+        {
+            std::lock_guard<std::mutex> lk(handle->mutex);
+            handle->waiting.clear();
+        }
+        std::lock_guard<std::mutex> lk(m_tasksMutex);
+        auto it = std::find(m_tasks.begin(), m_tasks.end(), handle);
+        if (it != m_tasks.end()) {
+            removed.push_back(std::move(*it));
+            m_tasks.erase(it);
+        }
+    }
 
-                // Release our reference to the task so the last thread can
-                // remove it from the list.
-                task.func.reset();
-
-                // Skip over completed tasks. Each of them should have threads
-                // waiting on this lock to come in and erase them.
-                while (iterator != m_multitasks.end() && !iterator->alive)
-                    ++iterator;
-
-                if (iterator == m_multitasks.end()) {
-                    m_multitasksCond.wait(
-                        lk, [&] { return !m_running || m_tasksAlive; });
-                    if (!m_running)
-                        return;
-                    iterator = m_multitasks.begin();
-                    while (!iterator->alive)
-                        ++iterator;
-                }
-                task = *iterator;
+    // Gives a worker another handle to the task
+    void add_handle(const task_handle &handle) {
+        worker &w = *m_workers[m_nextWorker.fetch_add(1) % m_workers.size()];
+        std::lock_guard<std::mutex> lk(w.mutex);
+        w.handles.push_back(handle);
+        w.update_queued();
+    }
+
+    // Returns true if the task was scaled down and the caller should drop
+    // its handle
+    static bool take_excess(task &t) {
+        size_t excess = t.excess.load();
+        while (excess && !t.excess.compare_exchange_weak(excess, excess - 1))
+            ;
+        return excess != 0;
+    }
+
+    // Called by the autoscale() thread
+    void rebalance() {
+        std::vector<task_handle> tasks;
+        {
+            std::lock_guard<std::mutex> lk(m_tasksMutex);
+            for (auto &handle : m_tasks)
+                if (handle->scaling && handle->alive.load())
+                    tasks.push_back(handle);
+        }
+        task *grow = nullptr;
+        task *shrink = nullptr;
+        double growPressure = 0.0;
+        double shrinkPressure = 0.0;
+        double topPressure = 0.0;
+        size_t total = 0;
+        for (auto &handle : tasks) {
+            task &t = *handle;
+            double pressure;
+            {
+                std::lock_guard<std::mutex> lk(t.scalingMutex);
+                if (!t.alive.load())
+                    continue;
+                pressure = t.scaling->pressure();
             }
-            taskDone = !(*task.func)();
+            size_t concurrency = t.concurrency.load();
+            total += concurrency;
+            topPressure = std::max(topPressure, pressure);
+            if (concurrency < t.scaling->max_concurrency &&
+                (!grow || pressure > growPressure)) {
+                grow = &t;
+                growPressure = pressure;
+            }
+            if (concurrency > t.scaling->min_concurrency &&
+                (!shrink || pressure < shrinkPressure)) {
+                shrink = &t;
+                shrinkPressure = pressure;
+            }
+        }
+        if (grow && growPressure <= 0.0)
+            grow = nullptr;
+        if (grow && total < m_workers.size()) {
+            resize(*grow, grow->concurrency.load() + 1);
+            return;
         }
+
+        // Every worker is spoken for. Take one from a task that is clearly
+        // less loaded than the busiest, even if the busiest is at its limit,
+        // as it then shares its workers with fewer other tasks.
+        if (!shrink || topPressure - shrinkPressure < 0.5)
+            return;
+        resize(*shrink, shrink->concurrency.load() - 1);
+        if (grow && grow != shrink)
+            resize(*grow, grow->concurrency.load() + 1);
+    }
+
+    void resize(task &t, size_t concurrency) {
+        std::lock_guard<std::mutex> scalingLk(t.scalingMutex);
+        if (!t.alive.load())
+            return;
+        size_t old = t.concurrency.exchange(concurrency);
+        if (concurrency < old) {
+            t.excess += old - concurrency;
+        } else {
+            for (size_t i = old; i < concurrency; ++i) {
+                // Cancel a pending drop rather than adding a handle
+                if (!take_excess(t))
+                    add_handle(t.shared_from_this());
+            }
+            std::lock_guard<std::mutex> lk(m_sleepMutex);
+            m_sleepCond.notify_all();
+        }
+        if (t.scaling->resized)
+            t.scaling->resized(concurrency);
+    }
+
+    void sleep(size_t index) {
+        detail::stat_timer<> timer(m_workers[index]->idleNs);
+        detail::trace_scope<> scope("idle", this);
+        std::unique_lock<std::mutex> lk(m_sleepMutex);
+        ++m_sleeping;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_sleepCond.wait(lk, [&] { return !m_running || any_queued(); });
+        --m_sleeping;
     }
 
-    std::list<Task> m_multitasks;
+    // Whether any worker's deque has a handle. Scans the workers rather
+    // than keeping a shared count, which every push and pop would write.
+    bool any_queued() const {
+        for (auto &w : m_workers)
+            if (w->queued.load(std::memory_order_relaxed))
+                return true;
+        return false;
+    }
+
+    std::vector<std::unique_ptr<worker>> m_workers;
+
+    // Owns every live task, including those with all handles waiting
+    std::mutex m_tasksMutex;
+    std::vector<task_handle> m_tasks;
+
+    // Spreads tasks with limited concurrency across the workers
+    std::atomic<size_t> m_nextWorker{0};
+
     std::vector<std::thread> m_threads;
-    std::mutex m_multitasksMutex;
-    std::condition_variable m_multitasksCond;
-    bool m_running{true};
-    size_t m_tasksAlive{0};
+    std::thread m_autoscaler;
+    std::atomic<bool> m_running{true};
+
+    // Workers waiting for a handle
+    std::atomic<size_t> m_sleeping{0};
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCond;
+    std::condition_variable m_autoscaleCond;
 };
 
 } // namespace psp
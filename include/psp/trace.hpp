@@ -0,0 +1,394 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stats.hpp"
+
+// Define to 1 to compile in trace events, which are recorded while a
+// trace_session exists. Like PSP_ENABLE_STATS, it must be the same in every
+// translation unit. When 0, every trace point compiles to nothing.
+#ifndef PSP_ENABLE_TRACE
+#define PSP_ENABLE_TRACE 0
+#endif
+
+namespace psp {
+
+inline constexpr bool trace_enabled = PSP_ENABLE_TRACE != 0;
+
+namespace detail {
+
+struct trace_event {
+    // Must outlive the trace, e.g. a string literal
+    const char *name;
+
+    // The stage, queue or task the event is about
+    const void *id;
+
+    std::uint64_t start_ns;
+
+    // Duration of a slice, or the value of a counter
+    std::uint64_t value;
+
+    // Chrome trace event phase: 'X' for slices, 'C' for counters
+    char phase;
+};
+
+// Events recorded by one thread. Only the owning thread appends and each
+// chunk's size is published with a release store, so recording never takes a
+// lock and a session can read the events while threads are still running.
+class trace_buffer {
+public:
+    static constexpr std::size_t chunk_size = 4096;
+
+    // Drop events past this many per thread rather than grow without bound
+    static constexpr std::size_t max_chunks = 256;
+
+    explicit trace_buffer(std::uint32_t tid)
+        : m_tid(tid), m_head(new chunk), m_tail(m_head) {}
+    ~trace_buffer() {
+        chunk *c = m_head;
+        while (c) {
+            chunk *next = c->next.load(std::memory_order_relaxed);
+            delete c;
+            c = next;
+        }
+    }
+    trace_buffer(const trace_buffer &other) = delete;
+    trace_buffer &operator=(const trace_buffer &other) = delete;
+
+    void append(const trace_event &event) {
+        std::size_t size = m_tail->size.load(std::memory_order_relaxed);
+        if (size == chunk_size) {
+            if (m_chunks == max_chunks) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            chunk *c = new chunk;
+            m_tail->next.store(c, std::memory_order_release);
+            m_tail = c;
+            ++m_chunks;
+            size = 0;
+        }
+        m_tail->events[size] = event;
+        m_tail->size.store(size + 1, std::memory_order_release);
+    }
+
+    // Calls func on every event published so far
+    template <class Func> void for_each(Func &&func) const {
+        for (chunk *c = m_head; c; c = c->next.load(std::memory_order_acquire)) {
+            std::size_t size = c->size.load(std::memory_order_acquire);
+            for (std::size_t i = 0; i < size; ++i)
+                func(c->events[i]);
+        }
+    }
+
+    std::uint32_t tid() const { return m_tid; }
+    std::uint64_t dropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+    // Shown as the thread's name in the trace viewer
+    void set_name(const char *name) {
+        m_name.store(name, std::memory_order_relaxed);
+    }
+    const char *name() const { return m_name.load(std::memory_order_relaxed); }
+
+private:
+    struct chunk {
+        trace_event events[chunk_size];
+        std::atomic<std::size_t> size{0};
+        std::atomic<chunk *> next{nullptr};
+    };
+
+    std::uint32_t m_tid;
+    std::atomic<const char *> m_name{nullptr};
+    std::atomic<std::uint64_t> m_dropped{0};
+    std::size_t m_chunks{1};
+    chunk *m_head;
+    chunk *m_tail;
+};
+
+// Every recording thread's trace_buffer. Buffers are shared with the
+// registry so their events can still be written after the thread exits, until
+// the last session ends. Then the registry lets go of them all, and threads
+// start new buffers the next time they record, so a long running process
+// only holds events from the current recording.
+class trace_registry {
+public:
+    static trace_registry &instance() {
+        static trace_registry registry;
+        return registry;
+    }
+
+    // The calling thread's buffer, created and registered on first use in
+    // each recording
+    trace_buffer &local() {
+        thread_state &state = local_state();
+        std::uint64_t generation =
+            m_generation.load(std::memory_order_relaxed);
+        if (!state.buffer || state.generation != generation) {
+            if (state.buffer)
+                remove(state.buffer);
+            state.buffer = add();
+            state.buffer->set_name(state.name);
+            state.generation = generation;
+        }
+        return *state.buffer;
+    }
+
+    // Names the calling thread's buffer, now or when it is created
+    void set_thread_name(const char *name) {
+        thread_state &state = local_state();
+        state.name = name;
+        if (state.buffer)
+            state.buffer->set_name(name);
+    }
+
+    std::vector<std::shared_ptr<trace_buffer>> buffers() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_buffers;
+    }
+
+    void begin_session() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (sessions.fetch_add(1) == 0)
+            ++m_generation;
+    }
+
+    // Frees the buffers of threads that have exited once the last session
+    // ends. Running threads free theirs when they next record.
+    void end_session() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (sessions.fetch_sub(1) == 1)
+            m_buffers.clear();
+    }
+
+    // Non-zero while a trace_session is recording
+    std::atomic<std::uint32_t> sessions{0};
+
+private:
+    struct thread_state {
+        ~thread_state() {
+            if (buffer)
+                instance().remove(buffer);
+        }
+        std::shared_ptr<trace_buffer> buffer;
+        std::uint64_t generation{0};
+        const char *name{nullptr};
+    };
+
+    static thread_state &local_state() {
+        thread_local thread_state t_state;
+        return t_state;
+    }
+
+    std::shared_ptr<trace_buffer> add() {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        auto buffer = std::make_shared<trace_buffer>(++m_lastTid);
+        m_buffers.push_back(buffer);
+        return buffer;
+    }
+
+    // Drops an exited or replaced thread's buffer, unless a session may
+    // still write its events
+    void remove(const std::shared_ptr<trace_buffer> &buffer) {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (sessions.load())
+            return;
+        m_buffers.erase(
+            std::remove(m_buffers.begin(), m_buffers.end(), buffer),
+            m_buffers.end());
+    }
+
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<trace_buffer>> m_buffers;
+    std::uint32_t m_lastTid{0};
+
+    // Incremented when recording starts, to replace buffers from earlier
+    // recordings
+    std::atomic<std::uint64_t> m_generation{0};
+};
+
+inline bool trace_recording() {
+    if constexpr (trace_enabled)
+        return trace_registry::instance().sessions.load(
+                   std::memory_order_relaxed) != 0;
+    else
+        return false;
+}
+
+// Records a slice from construction to destruction, if a session is
+// recording when it starts
+template <bool Enabled = trace_enabled> class trace_scope {
+public:
+    trace_scope(const char *name, const void *id)
+        : m_name(name), m_id(id),
+          m_start(trace_recording() ? stats_now_ns() : 0) {}
+    ~trace_scope() {
+        if (m_start)
+            trace_registry::instance().local().append(
+                {m_name, m_id, m_start, stats_now_ns() - m_start, 'X'});
+    }
+    trace_scope(const trace_scope &other) = delete;
+    trace_scope &operator=(const trace_scope &other) = delete;
+
+private:
+    const char *m_name;
+    const void *m_id;
+    std::uint64_t m_start;
+};
+
+template <> class trace_scope<false> {
+public:
+    trace_scope(const char *, const void *) {}
+};
+
+// Records a counter sample, e.g. a queue's size. Value is only evaluated
+// while recording.
+template <class ValueFunc>
+void trace_counter(const char *name, const void *id, ValueFunc &&value) {
+    if constexpr (trace_enabled) {
+        if (trace_recording())
+            trace_registry::instance().local().append(
+                {name, id, stats_now_ns(), std::uint64_t(value()), 'C'});
+    }
+}
+
+// Names the calling thread in traces. Does not create a buffer, so threads
+// that never record cost nothing.
+inline void trace_thread_name(const char *name) {
+    if constexpr (trace_enabled)
+        trace_registry::instance().set_thread_name(name);
+}
+
+inline void write_json_string(std::ostream &out, const char *str) {
+    out << '"';
+    for (; *str; ++str) {
+        char c = *str;
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        } else
+            out << c;
+    }
+    out << '"';
+}
+
+inline void write_trace_time(std::ostream &out, std::uint64_t ns) {
+    // Chrome expects microseconds
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%llu.%03u",
+                  static_cast<unsigned long long>(ns / 1000),
+                  static_cast<unsigned>(ns % 1000));
+    out << buffer;
+}
+
+} // namespace detail
+
+/**
+ * @brief Records trace events while it exists, then writes them out
+ *
+ * With PSP_ENABLE_TRACE=1, thread_pool workers record slices for each
+ * multitask call and while idle, stages for each batch of items they process,
+ * and stream_queues record their size on every push and pop and slices while
+ * threads block on them. The result is Chrome trace event JSON, which can be
+ * opened in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Events are kept until the last session ends, then freed, so sessions may
+ * come and go in a long running process. Events recorded before the session
+ * started are not written.
+ *
+ * Example:
+ * @code
+ * psp::trace_session trace("pipeline.json");
+ * run_pipeline();
+ * @endcode
+ */
+class trace_session {
+public:
+    // Writes to path when destroyed, unless path is empty
+    explicit trace_session(std::string path = {})
+        : m_path(std::move(path)), m_start(detail::stats_now_ns()) {
+        if constexpr (trace_enabled)
+            detail::trace_registry::instance().begin_session();
+    }
+    ~trace_session() {
+        if (!m_path.empty()) {
+            std::ofstream file(m_path);
+            write(file);
+        }
+        if constexpr (trace_enabled)
+            detail::trace_registry::instance().end_session();
+    }
+    trace_session(const trace_session &other) = delete;
+    trace_session &operator=(const trace_session &other) = delete;
+
+    // Writes events recorded since the session started
+    void write(std::ostream &out) const {
+        out << "{\"traceEvents\":[";
+        const char *separator = "\n";
+        std::uint64_t dropped = 0;
+        if constexpr (trace_enabled) {
+            for (auto &buffer : detail::trace_registry::instance().buffers()) {
+                dropped += buffer->dropped();
+                if (const char *name = buffer->name()) {
+                    out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\","
+                        << "\"pid\":1,\"tid\":" << buffer->tid()
+                        << ",\"args\":{\"name\":";
+                    detail::write_json_string(out, name);
+                    out << "}}";
+                    separator = ",\n";
+                }
+                buffer->for_each([&](const detail::trace_event &event) {
+                    if (event.start_ns < m_start)
+                        return;
+                    out << separator << "{\"name\":";
+                    detail::write_json_string(out, event.name);
+                    out << ",\"ph\":\"" << event.phase
+                        << "\",\"pid\":1,\"tid\":" << buffer->tid()
+                        << ",\"ts\":";
+                    detail::write_trace_time(out, event.start_ns - m_start);
+                    char id[32];
+                    std::snprintf(id, sizeof(id), "%p", event.id);
+                    if (event.phase == 'C') {
+                        out << ",\"id\":\"" << id << "\",\"args\":{\"value\":"
+                            << event.value << "}}";
+                    } else {
+                        out << ",\"dur\":";
+                        detail::write_trace_time(out, event.value);
+                        out << ",\"args\":{\"id\":\"" << id << "\"}}";
+                    }
+                    separator = ",\n";
+                });
+            }
+        }
+        out << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":"
+            << dropped << "}}\n";
+    }
+
+private:
+    std::string m_path;
+    std::uint64_t m_start;
+};
+
+} // namespace psp
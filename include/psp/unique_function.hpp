@@ -0,0 +1,69 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace psp {
+
+template <class Signature> class unique_function;
+
+/**
+ * @brief Move-only std::function
+ *
+ * Holds any callable, including lambdas that capture std::unique_ptrs or
+ * other move-only state, which std::function rejects because it must be
+ * copyable. Moving a unique_function moves the pointer to the callable, never
+ * the callable itself.
+ */
+template <class R, class... Args> class unique_function<R(Args...)> {
+public:
+    unique_function() = default;
+    unique_function(std::nullptr_t) {}
+    template <class Func,
+              class = std::enable_if_t<
+                  !std::is_same_v<std::decay_t<Func>, unique_function> &&
+                  std::is_invocable_r_v<R, std::decay_t<Func> &, Args...>>>
+    unique_function(Func &&func)
+        : m_callable(std::make_unique<callable<std::decay_t<Func>>>(
+              std::forward<Func>(func))) {}
+    unique_function(unique_function &&other) = default;
+    unique_function &operator=(unique_function &&other) = default;
+    unique_function(const unique_function &other) = delete;
+    unique_function &operator=(const unique_function &other) = delete;
+
+    R operator()(Args... args) {
+        return m_callable->call(std::forward<Args>(args)...);
+    }
+    explicit operator bool() const { return m_callable != nullptr; }
+
+private:
+    struct callable_base {
+        virtual ~callable_base() = default;
+        virtual R call(Args &&...args) = 0;
+    };
+
+    template <class Func> struct callable final : callable_base {
+        template <class F> explicit callable(F &&f) : func(std::forward<F>(f)) {}
+        R call(Args &&...args) override {
+            if constexpr (std::is_void_v<R>)
+                std::invoke(func, std::forward<Args>(args)...);
+            else
+                return std::invoke(func, std::forward<Args>(args)...);
+        }
+        Func func;
+    };
+
+    std::unique_ptr<callable_base> m_callable;
+};
+
+} // namespace psp
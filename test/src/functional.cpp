@@ -5,14 +5,25 @@
  * https://opensource.org/licenses/MIT.
  */
 
+#include <psp/partitioned.hpp>
+#include <psp/pipeline.hpp>
+#include <psp/reduce.hpp>
+#include <psp/ring_buffer.hpp>
 #include <psp/stream_processor.hpp>
 #include <psp/thread_pool.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <gtest/gtest.h>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <stdio.h>
+#include <string>
 #include <thread>
 
 using namespace psp;
@@ -171,6 +182,82 @@ TEST(Functional, StressPipeline) {
     EXPECT_EQ(sum, 1);
 }
 
+TEST(Functional, PipelineFused) {
+    std::vector<int> thingsToDo;
+    for (int i = 0; i < 10; ++i)
+        thingsToDo.push_back(i);
+    auto increment = [](int item) -> int { return item + 1; };
+    auto decrement = [](int item) -> int { return item - 1; };
+    auto toString = [](int item) -> std::string { return std::to_string(item); };
+
+    // Fused into a single stage, with one queue
+    auto strings =
+        source(thingsToDo) | map(increment) | map(decrement) | map(toString) |
+        parallel(2);
+    std::set<std::string> result(strings.begin(), strings.end());
+    EXPECT_EQ(result.size(), 10);
+    EXPECT_EQ(result.count("0"), 1);
+    EXPECT_EQ(result.count("9"), 1);
+
+    // A sink runs what is left on the calling thread
+    int sum = 0;
+    source(thingsToDo) | map(increment) | for_each([&](int i) { sum += i; });
+    EXPECT_EQ(sum, 55);
+
+    // Temporary pipelines move the mapped functions along rather than
+    // copying them, so they may be move-only
+    auto add = [](int amount) {
+        return [amount = std::make_unique<int>(amount)](int item) -> int {
+            return item + *amount;
+        };
+    };
+    sum = 0;
+    source(thingsToDo) | map(add(2)) | for_each([&](int i) { sum += i; });
+    EXPECT_EQ(sum, 65);
+    auto added =
+        source(thingsToDo) | map(add(1)) | map(add(1)) | parallel(2);
+    sum = 0;
+    for (int i : added)
+        sum += i;
+    EXPECT_EQ(sum, 65);
+    auto evens = source(thingsToDo) | map(add(1)) |
+                 filter([](int i) { return i % 2 == 0; }) | parallel(2);
+    sum = 0;
+    for (int i : evens)
+        sum += i;
+    EXPECT_EQ(sum, 30);
+    EXPECT_EQ(source(thingsToDo) | map(add(1)) |
+                  reduce(0, std::plus<int>(), std::plus<int>()),
+              55);
+}
+
+// Appends count copies of func to the pipeline
+template <int Count, class Pipeline, class Func>
+auto map_repeat(const Pipeline &p, Func func) {
+    if constexpr (Count == 0)
+        return p;
+    else
+        return map_repeat<Count - 1>(p | map(func), func);
+}
+
+TEST(Functional, PipelineStress) {
+    std::vector<int> input;
+    for (int i = 1; i < 1000; ++i)
+        input.push_back(i);
+    auto collatz = [](int x) -> int {
+        if (x <= 1)
+            return 0;
+        return (x & 1) ? 3 * x + 1 : x / 2;
+    };
+
+    // Same as StressPipeline, but with 178 functions in two fused stages
+    auto first = map_repeat<89>(source(input), collatz) | parallel(2);
+    auto second = map_repeat<89>(first, collatz) | parallel(2);
+    int sum = 0;
+    second | for_each([&](int item) { sum += item; });
+    EXPECT_EQ(sum, 1);
+}
+
 TEST(Functional, ThreadPoolLockstep) {
     std::vector<int> thingsToDo;
     for (int i = 0; i < 10; ++i)
@@ -206,6 +293,100 @@ TEST(Functional, ThreadPoolLockstep) {
     EXPECT_EQ(sum, 45);
 }
 
+TEST(Functional, ThreadPoolManyTasks) {
+    // More tasks than threads, finishing at different times, so workers run
+    // out of their own handles and steal from the others
+    const int taskCount = 64;
+    std::atomic<int> work{0};
+    std::atomic<int> finished{0};
+    std::vector<std::weak_ptr<std::atomic<int>>> counters;
+    thread_pool threads(4);
+    for (int i = 0; i < taskCount; ++i) {
+        auto remaining = std::make_shared<std::atomic<int>>(i * 10);
+        counters.push_back(remaining);
+        threads.process([&, remaining]() -> bool {
+            int left = remaining->fetch_sub(1);
+            if (left > 0) {
+                ++work;
+                return true;
+            }
+            // Other workers may still be calling it after the first false
+            if (left == 0)
+                ++finished;
+            return false;
+        });
+    }
+    while (finished.load() < taskCount)
+        std::this_thread::yield();
+
+    // Retired tasks are destroyed once no worker is still calling them
+    for (auto &counter : counters)
+        while (!counter.expired())
+            std::this_thread::yield();
+    EXPECT_EQ(work.load(), 10 * taskCount * (taskCount - 1) / 2);
+}
+
+TEST(Functional, ThreadPoolWaker) {
+    // A waiting task is not called again until it is woken
+    std::atomic<int> calls{0};
+    std::mutex mutex;
+    thread_pool::waker waker;
+    thread_pool threads(2);
+    threads.process([&]() -> task_status {
+        if (++calls == 3)
+            return task_status::finished;
+        std::lock_guard<std::mutex> lk(mutex);
+        waker = thread_pool::current_waker();
+        return task_status::waiting;
+    });
+    auto wake = [&] {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (!waker)
+            return false;
+        waker();
+        return true;
+    };
+    while (!wake())
+        std::this_thread::yield();
+    while (calls.load() < 3) {
+        wake();
+        std::this_thread::yield();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(calls.load(), 3);
+}
+
+TEST(Functional, ThreadPoolDeepPipeline) {
+    std::vector<int> input;
+    for (int i = 1; i < 1000; ++i)
+        input.push_back(i);
+    auto collatz = [](int x) -> int {
+        if (x <= 1)
+            return 0;
+        return (x & 1) ? 3 * x + 1 : x / 2;
+    };
+
+    // Many more stages than threads. Starved stages wait to be woken by their
+    // queues rather than holding a thread.
+    stream_options options;
+    options.capacity = 4;
+    thread_pool threads(2);
+    parallel_streams first(input.begin(), input.end(), collatz, threads,
+                           options);
+    using Processor =
+        parallel_streams<decltype(first)::iterator, decltype(collatz)>;
+    std::vector<std::unique_ptr<Processor>> processors;
+    for (int i = 0; i < 177; ++i)
+        processors.push_back(std::make_unique<Processor>(
+            i == 0 ? first.begin() : processors.back()->begin(),
+            i == 0 ? first.end() : processors.back()->end(), collatz, threads,
+            options));
+    int sum = 0;
+    for (auto &item : *processors.back())
+        sum += item;
+    EXPECT_EQ(sum, 1);
+}
+
 TEST(Functional, DifferentTypes) {
     std::vector<int> input{1, 2, 3};
     std::set<std::string> expected{"1", "4", "9"};
@@ -217,4 +398,739 @@ TEST(Functional, DifferentTypes) {
         [](int i) { return std::to_string(i); }, threads);
     std::set<std::string> result(squareStrings.begin(), squareStrings.end());
     EXPECT_EQ(result, expected);
-}
\ No newline at end of file
+}
+
+TEST(Functional, RingBufferPipeline) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+    auto increment = [](int item) -> int { return item + 1; };
+    auto decrement = [](int item) -> int { return item - 1; };
+
+    // Several threads writing to one reader, then one thread to one reader
+    using First = parallel_streams<std::vector<int>::iterator,
+                                   decltype(increment), mpsc_ring_buffer<int>>;
+    First first(input.begin(), input.end(), increment, 4);
+    parallel_streams<First::iterator, decltype(decrement),
+                     spsc_ring_buffer<int>>
+        second(first.begin(), first.end(), decrement, 1);
+    int sum = 0;
+    for (auto &item : second)
+        sum += item;
+    EXPECT_EQ(sum, 499500);
+}
+
+TEST(Functional, BoundedBackpressure) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+    const size_t threadCount = 2;
+    stream_options options;
+    options.capacity = 4;
+    std::atomic<int> produced{0};
+    auto increment = [&](int item) -> int {
+        ++produced;
+        return item + 1;
+    };
+    parallel_streams runner(input.begin(), input.end(), increment, threadCount,
+                            options);
+    int consumed = 0;
+    int sum = 0;
+    for (auto &item : runner) {
+        // Everything produced is either consumed, in the queue, waiting in a
+        // thread's push() or just popped by this loop
+        ++consumed;
+        EXPECT_LE(produced.load(), consumed + options.capacity + threadCount);
+        sum += item;
+    }
+    EXPECT_EQ(sum, 500500);
+}
+
+TEST(Functional, BoundedThreadPool) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+    stream_options options;
+    options.capacity = 1;
+
+    // The producing and consuming stages share a small pool. Pool threads must
+    // not block on a full queue or the stage draining it may never run.
+    thread_pool threads(2);
+    auto increment = [](int item) -> int { return item + 1; };
+    auto decrement = [](int item) -> int { return item - 1; };
+    parallel_streams first(input.begin(), input.end(), increment, threads,
+                           options);
+    parallel_streams second(first.begin(), first.end(), decrement, threads,
+                            options);
+    parallel_streams third(second.begin(), second.end(), increment, threads,
+                           options);
+    int sum = 0;
+    for (auto &item : third)
+        sum += item;
+    EXPECT_EQ(sum, 500500);
+}
+
+TEST(Functional, Batches) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+    stream_options options;
+    options.batch_size = 16;
+    auto increment = [](int item) -> int { return item + 1; };
+    auto decrement = [](int item) -> int { return item - 1; };
+    parallel_streams first(input.begin(), input.end(), increment, 2, options);
+    thread_pool threads(2);
+    parallel_streams second(first.begin(), first.end(), decrement, threads,
+                            options);
+    int sum = 0;
+    for (auto &item : second.drain(options.batch_size))
+        sum += item;
+    EXPECT_EQ(sum, 499500);
+}
+
+TEST(Functional, Ordered) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+    stream_options options;
+    options.ordered = true;
+    options.reorder_window = 8;
+
+    // Make early items slow so later ones finish first
+    auto slowStart = [](int item) -> int {
+        if (item % 100 == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return item;
+    };
+    parallel_streams first(input.begin(), input.end(), slowStart, 4, options);
+    options.batch_size = 3;
+    thread_pool threads(3);
+    parallel_streams second(first.begin(), first.end(), slowStart, threads,
+                            options);
+    int expected = 0;
+    for (auto &item : second)
+        EXPECT_EQ(item, expected++);
+    EXPECT_EQ(expected, 1000);
+
+    // Random access input on the pool, whose tasks wait for the window
+    parallel_streams third(input.begin(), input.end(), slowStart, threads,
+                           options);
+    expected = 0;
+    for (auto &item : third)
+        EXPECT_EQ(item, expected++);
+    EXPECT_EQ(expected, 1000);
+}
+
+TEST(Functional, RandomAccessChunks) {
+    static_assert(is_random_access_input<std::vector<int>::iterator>());
+    static_assert(!is_random_access_input<std::list<int>::iterator>());
+    static_assert(!is_random_access_input<stream_queue<int>::iterator>());
+
+    std::vector<int> input(10000);
+    for (int i = 0; i < (int)input.size(); ++i)
+        input[i] = i;
+    for (size_t grain : {0, 1, 7, 100000}) {
+        stream_options options;
+        options.grain_size = grain;
+        std::vector<std::atomic<int>> seen(input.size());
+        auto mark = [&](int item) -> int {
+            seen[item]++;
+            return item;
+        };
+        parallel_streams runner(input.begin(), input.end(), mark, 4, options);
+        long long sum = 0;
+        for (auto &item : runner)
+            sum += item;
+        EXPECT_EQ(sum, 49995000);
+        for (auto &count : seen)
+            EXPECT_EQ(count, 1);
+    }
+
+    // Chunks are split into batches, and can be ordered
+    stream_options options;
+    options.batch_size = 3;
+    options.ordered = true;
+    options.reorder_window = 64;
+    auto identity = [](int item) -> int { return item; };
+    parallel_streams ordered(input.begin(), input.end(), identity, 4, options);
+    int expected = 0;
+    for (auto &item : ordered)
+        EXPECT_EQ(item, expected++);
+    EXPECT_EQ(expected, (int)input.size());
+}
+
+TEST(Functional, ListInput) {
+    std::list<int> input{1, 2, 3, 4};
+    auto square = [](int i) { return i * i; };
+    parallel_streams squares(input.begin(), input.end(), square, 2);
+    int sum = 0;
+    for (auto &item : squares)
+        sum += item;
+    EXPECT_EQ(sum, 30);
+}
+
+TEST(Functional, ParallelReduce) {
+    std::vector<int> input;
+    for (int i = 1; i <= 10000; ++i)
+        input.push_back(i);
+    auto add = [](int64_t total, int i) { return total + i; };
+    auto combine = [](int64_t a, int64_t b) { return a + b; };
+
+    // Batches smaller than the input so threads interleave
+    parallel_reduce sum(input.begin(), input.end(), int64_t(0), add, combine,
+                        4, 7);
+    EXPECT_EQ(sum.get(), 50005000);
+    EXPECT_EQ(sum.get(), 50005000);
+
+    thread_pool threads(3);
+    EXPECT_EQ(fold(input.begin(), input.end(), int64_t(0), add, combine,
+                   threads, 7),
+              50005000);
+
+    // Nothing to fold gives the identity
+    EXPECT_EQ(fold(input.end(), input.end(), int64_t(0), add, combine, 2), 0);
+}
+
+TEST(Functional, ParallelReduceQueue) {
+    std::list<int> input;
+    for (int i = 1; i <= 1000; ++i)
+        input.push_back(i);
+    auto square = [](int i) { return i * i; };
+    auto collect = [](std::vector<int> items, int i) {
+        items.push_back(i);
+        return items;
+    };
+    auto concat = [](std::vector<int> a, std::vector<int> b) {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    };
+
+    // Folding the output queue of a stage on the same pool, without a
+    // consumer thread
+    thread_pool threads(2);
+    stream_options options;
+    options.capacity = 16;
+    parallel_streams squares(input.begin(), input.end(), square, threads,
+                             options);
+    std::vector<int> result = fold(squares.begin(), squares.end(),
+                                   std::vector<int>(), collect, concat, threads,
+                                   5);
+    std::sort(result.begin(), result.end());
+    ASSERT_EQ(result.size(), input.size());
+    for (int i = 1; i <= 1000; ++i)
+        EXPECT_EQ(result[i - 1], i * i);
+}
+
+TEST(Functional, PipelineReduce) {
+    std::vector<int> input;
+    for (int i = 1; i <= 100; ++i)
+        input.push_back(i);
+    auto square = [](int i) { return i * i; };
+
+    // Mapped functions run inside the reduction
+    int total = source(input) | map(square) |
+                reduce(0, std::plus<int>(), std::plus<int>(), 3);
+    EXPECT_EQ(total, 338350);
+
+    thread_pool threads(2);
+    total = source(input) | map(square) | parallel(threads) |
+            reduce(0, std::plus<int>(), std::plus<int>(), threads);
+    EXPECT_EQ(total, 338350);
+}
+
+TEST(Functional, Filter) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+
+    // Predicates push accepted items as they are
+    parallel_streams odd(input.begin(), input.end(),
+                         filter([](int i) { return i % 2 == 1; }), 2);
+    std::vector<int> result(odd.begin(), odd.end());
+    EXPECT_EQ(result.size(), 500);
+    EXPECT_EQ(odd.size(), 0);
+
+    // Optional results push only engaged values, here in order and batched
+    stream_options options;
+    options.ordered = true;
+    options.batch_size = 7;
+    parallel_streams halves(
+        input.begin(), input.end(),
+        filter([](int i) -> std::optional<std::string> {
+            if (i % 2)
+                return std::nullopt;
+            return std::to_string(i / 2);
+        }),
+        3, options);
+    std::vector<std::string> strings(halves.begin(), halves.end());
+    ASSERT_EQ(strings.size(), 500);
+    for (int i = 0; i < 500; ++i)
+        EXPECT_EQ(strings[i], std::to_string(i));
+}
+
+TEST(Functional, FilterKeepsInput) {
+    std::vector<std::string> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back("item " + std::to_string(i));
+    const std::vector<std::string> original = input;
+
+    // Random access inputs are read in place, so kept items must be copied
+    auto even = [](const std::string &s) { return (s.back() - '0') % 2 == 0; };
+    for (bool ordered : {false, true}) {
+        stream_options options;
+        options.ordered = ordered;
+        options.batch_size = ordered ? 7 : 1;
+        parallel_streams kept(input.begin(), input.end(), filter(even), 2,
+                              options);
+        std::vector<std::string> result(kept.begin(), kept.end());
+        EXPECT_EQ(result.size(), 500);
+        EXPECT_EQ(input, original);
+    }
+    std::vector<std::string> piped;
+    source(input) | filter(even) |
+        for_each([&](std::string s) { piped.push_back(std::move(s)); });
+    EXPECT_EQ(piped.size(), 500);
+    EXPECT_EQ(input, original);
+}
+
+TEST(Functional, FlatMap) {
+    std::list<int> input;
+    for (int i = 0; i < 100; ++i)
+        input.push_back(i);
+
+    // Returning a range
+    parallel_streams repeated(input.begin(), input.end(),
+                              flat_map([](int i) {
+                                  return std::vector<int>(size_t(i % 4), i);
+                              }),
+                              2);
+    int sum = 0;
+    size_t count = 0;
+    for (int i : repeated) {
+        sum += i;
+        ++count;
+    }
+    EXPECT_EQ(count, 150);
+
+    // Calling an emitter, in order on a bounded thread pool stage
+    thread_pool threads(2);
+    stream_options options;
+    options.ordered = true;
+    options.capacity = 4;
+    options.batch_size = 3;
+    parallel_streams emitted(
+        input.begin(), input.end(),
+        flat_map([](int i, emitter<int> &emit) {
+            for (int j = 0; j < i % 4; ++j)
+                emit(i);
+        }),
+        threads, options);
+    std::vector<int> result(emitted.begin(), emitted.end());
+    EXPECT_EQ(result.size(), 150);
+    EXPECT_TRUE(std::is_sorted(result.begin(), result.end()));
+    int emittedSum = 0;
+    for (int i : result)
+        emittedSum += i;
+    EXPECT_EQ(emittedSum, sum);
+}
+
+TEST(Functional, PipelineFilter) {
+    std::vector<int> input;
+    for (int i = 1; i <= 100; ++i)
+        input.push_back(i);
+    auto square = [](int i) { return i * i; };
+    auto even = [](int i) { return i % 2 == 0; };
+    auto twice = [](int i, emitter<int> &emit) {
+        emit(i);
+        emit(i);
+    };
+
+    // Maps before a filter run in the same stage
+    auto evens = source(input) | map(square) | filter(even) | parallel(2);
+    int64_t sum = 0;
+    evens | map(square) | flat_map(twice) |
+        for_each([&](int i) { sum += i; });
+    int64_t expected = 0;
+    for (int64_t i = 2; i <= 100; i += 2)
+        expected += 2 * i * i * i * i;
+    EXPECT_EQ(sum, expected);
+
+    int total = source(input) | filter(even) |
+                reduce(0, std::plus<int>(), std::plus<int>(), 2);
+    EXPECT_EQ(total, 2550);
+}
+
+// Counts copies of itself, to check items are only ever moved
+struct copy_counter {
+    static inline std::atomic<int> copies{0};
+    copy_counter(int value = 0) : value(value) {}
+    copy_counter(const copy_counter &other) : value(other.value) { ++copies; }
+    copy_counter(copy_counter &&other) = default;
+    copy_counter &operator=(const copy_counter &other) {
+        value = other.value;
+        ++copies;
+        return *this;
+    }
+    copy_counter &operator=(copy_counter &&other) = default;
+    int value;
+};
+
+TEST(Functional, NoCopies) {
+    std::vector<copy_counter> input;
+    for (int i = 0; i < 1000; ++i)
+        input.emplace_back(i);
+    for (bool ordered : {false, true}) {
+        for (std::size_t batch : {1, 16}) {
+            copy_counter::copies = 0;
+            stream_options options;
+            options.ordered = ordered;
+            options.batch_size = batch;
+            parallel_streams first(
+                input.begin(), input.end(),
+                [](const copy_counter &c) { return copy_counter(c.value * 2); },
+                2, options);
+            parallel_streams second(
+                first.begin(), first.end(),
+                [](copy_counter c) {
+                    c.value += 1;
+                    return c;
+                },
+                2, options);
+            int64_t sum = 0;
+            for (auto &c : second)
+                sum += c.value;
+            EXPECT_EQ(sum, 1000 * 999 + 1000);
+            EXPECT_EQ(copy_counter::copies.load(), 0);
+        }
+    }
+}
+
+TEST(Functional, MoveOnly) {
+    std::vector<int> input(100, 1);
+    auto offset = std::make_unique<int>(1);
+    parallel_streams boxed(input.begin(), input.end(),
+                           [offset = std::move(offset)](int i) {
+                               return std::make_unique<int>(i + *offset);
+                           });
+    thread_pool threads(2);
+    parallel_streams unboxed(
+        boxed.begin(), boxed.end(),
+        [](std::unique_ptr<int> i) { return *i; }, threads);
+    int sum = 0;
+    for (int i : unboxed)
+        sum += i;
+    EXPECT_EQ(sum, 200);
+
+    // Tasks may own move-only state too
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+    auto value = std::make_unique<int>(42);
+    int result = 0;
+    threads.process([value = std::move(value), &result, &mutex, &cond,
+                     &done]() {
+        std::lock_guard<std::mutex> lk(mutex);
+        result = *value;
+        done = true;
+        cond.notify_all();
+        return false;
+    });
+    std::unique_lock<std::mutex> lk(mutex);
+    cond.wait(lk, [&] { return done; });
+    EXPECT_EQ(result, 42);
+}
+
+TEST(Functional, Partitioned) {
+    struct Event {
+        int key;
+        int sequence;
+    };
+    const int keys = 13;
+    std::vector<Event> input;
+    for (int i = 0; i < 10000; ++i)
+        input.push_back({i % keys, i / keys});
+
+    // Each lane sees its keys in order, and so can keep unlocked state
+    auto check = [last = std::vector<int>(keys, -1)](const Event &e) mutable {
+        EXPECT_EQ(last[e.key] + 1, e.sequence);
+        last[e.key] = e.sequence;
+        return e;
+    };
+    stream_options options;
+    options.capacity = 64;
+    partitioned_streams lanes(
+        input.begin(), input.end(), [](const Event &e) { return e.key; },
+        check, 4, options);
+    EXPECT_EQ(lanes.lane_count(), 4U);
+
+    // As does anything reading the output
+    std::vector<int> last(keys, -1);
+    int count = 0;
+    for (auto &e : lanes) {
+        EXPECT_EQ(last[e.key] + 1, e.sequence);
+        last[e.key] = e.sequence;
+        ++count;
+    }
+    EXPECT_EQ(count, 10000);
+}
+
+TEST(Functional, PartitionedQueue) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+    auto identity = [](int i) { return i; };
+    parallel_streams source(input.begin(), input.end(), identity, 1);
+    partitioned_streams odd(
+        source.begin(), source.end(), [](int i) { return i % 2; },
+        filter([](int i) { return i % 2 == 1; }), 2);
+    int sum = 0;
+    for (int i : odd)
+        sum += i;
+    EXPECT_EQ(sum, 250000);
+}
+
+TEST(Functional, Autoscale) {
+    std::vector<int> input(2000, 1);
+    thread_pool threads(4);
+    threads.autoscale(std::chrono::milliseconds(1));
+    stream_options options;
+    options.capacity = 64;
+    auto fast = [](int i) { return i; };
+    auto slow = [](int i) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        return i;
+    };
+    parallel_streams first(input.begin(), input.end(), fast, threads, options);
+    parallel_streams second(first.begin(), first.end(), slow, threads,
+                            options);
+    EXPECT_EQ(first.concurrency(), 4U);
+    EXPECT_EQ(second.concurrency(), 4U);
+
+    // Workers move between the stages as they run, within the limits. How
+    // far they move depends on timing, so is checked below instead.
+    int sum = 0;
+    for (int i : second) {
+        sum += i;
+        EXPECT_GE(first.concurrency(), 1U);
+        EXPECT_LE(first.concurrency(), 4U);
+    }
+    EXPECT_EQ(sum, 2000);
+}
+
+TEST(Functional, AutoscalePressure) {
+    // Two tasks with pressures set by the test, so where the workers end up
+    // does not depend on timing
+    struct scaled {
+        std::atomic<double> pressure;
+        std::atomic<size_t> concurrency{4};
+    };
+    scaled a{{-1.0}}, b{{1.0}};
+    std::atomic<bool> stop{false};
+    thread_pool threads(4);
+    threads.autoscale(std::chrono::milliseconds(1));
+    for (scaled *t : {&a, &b}) {
+        task_scaling scaling;
+        scaling.pressure = [t] { return t->pressure.load(); };
+        scaling.resized = [t](size_t n) { t->concurrency = n; };
+        threads.process(
+            [&stop] {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                return !stop.load();
+            },
+            4, std::move(scaling));
+    }
+
+    // Waits for the autoscaler to settle, however long the scheduler takes
+    auto settles = [](scaled &low, scaled &high) {
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(30);
+        while ((low.concurrency.load() != 1 || high.concurrency.load() != 4) &&
+               std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return low.concurrency.load() == 1 && high.concurrency.load() == 4;
+    };
+
+    // Workers leave the idle task down to its minimum and the busy task
+    // keeps them all, then the reverse once the pressures swap
+    EXPECT_TRUE(settles(a, b));
+    a.pressure = 1.0;
+    b.pressure = -1.0;
+    EXPECT_TRUE(settles(b, a));
+    stop = true;
+}
+
+TEST(Functional, WithState) {
+    std::vector<int> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back(i);
+    struct scratch {
+        std::thread::id owner = std::this_thread::get_id();
+        std::vector<int> buffer;
+        int calls = 0;
+    };
+    std::atomic<int> created{0};
+    auto sum = with_state(
+        [&created] {
+            ++created;
+            return scratch();
+        },
+        [](scratch &s, int i) {
+            // Only ever used by the thread that made it
+            EXPECT_EQ(s.owner, std::this_thread::get_id());
+            ++s.calls;
+            s.buffer.assign(i, 1);
+            return int(s.buffer.size());
+        });
+    thread_pool threads(3);
+    parallel_streams sizes(input.begin(), input.end(),
+                           [&sum](int i) { return sum(i); }, threads);
+    int total = 0;
+    for (int i : sizes)
+        total += i;
+    EXPECT_EQ(total, 999 * 500);
+    EXPECT_GE(created.load(), 1);
+    EXPECT_LE(created.load(), 3);
+    int calls = 0;
+    sum.for_each_state([&calls](scratch &s) { calls += s.calls; });
+    EXPECT_EQ(calls, 1000);
+
+    // Stages hold their own copy, with its own states
+    parallel_streams direct(input.begin(), input.end(), sum, 2);
+    total = 0;
+    for (int i : direct)
+        total += i;
+    EXPECT_EQ(total, 999 * 500);
+}
+
+TEST(Functional, BatchMap) {
+    std::vector<int> input;
+    for (int i = 0; i < 10000; ++i)
+        input.push_back(i);
+    std::atomic<int> calls{0};
+    auto twice = batch_map([&calls](span<const int> in, span<int64_t> out) {
+        ++calls;
+        for (std::size_t i = 0; i < in.size(); ++i)
+            out[i] = int64_t(in[i]) * 2;
+    });
+    for (bool ordered : {false, true}) {
+        stream_options options;
+        options.ordered = ordered;
+        calls = 0;
+        parallel_streams doubled(input.begin(), input.end(), twice, 2, options);
+        int64_t sum = 0;
+        int64_t expected = 0;
+        for (int64_t i : doubled) {
+            if (ordered) {
+                EXPECT_EQ(i, expected);
+            }
+            sum += i;
+            expected += 2;
+        }
+        EXPECT_EQ(sum, 9999LL * 10000);
+        EXPECT_LT(calls.load(), 100);
+    }
+
+    // Runs drained from a queue
+    auto identity = [](int i) { return i; };
+    parallel_streams source(input.begin(), input.end(), identity, 1);
+    thread_pool threads(2);
+    parallel_streams doubled(source.begin(), source.end(), twice, threads);
+    int64_t sum = 0;
+    for (int64_t i : doubled)
+        sum += i;
+    EXPECT_EQ(sum, 9999LL * 10000);
+}
+
+TEST(Functional, Cancel) {
+    std::vector<int> input(1000000, 1);
+    std::atomic<int> calls{0};
+    auto counted = [&calls](int i) {
+        ++calls;
+        return i;
+    };
+    stream_options options;
+    options.capacity = 16;
+    thread_pool threads(2);
+
+    // Breaking out early stops both stages, one on threads and the other on
+    // a pool, long before the end of the input
+    {
+        parallel_streams first(input.begin(), input.end(), counted, 2,
+                               options);
+        parallel_streams second(first.begin(), first.end(), counted, threads,
+                                options);
+        int seen = 0;
+        for (int i : second) {
+            seen += i;
+            if (seen == 10)
+                break;
+        }
+    }
+    EXPECT_LT(calls.load(), 10000);
+
+    // Explicitly, ending the stream for the reader
+    calls = 0;
+    parallel_streams first(input.begin(), input.end(), counted, threads,
+                           options);
+    parallel_streams second(first.begin(), first.end(), counted, 2, options);
+    int seen = 0;
+    for (int i : second) {
+        seen += i;
+        if (seen == 10)
+            second.cancel();
+    }
+    EXPECT_GE(seen, 10);
+    EXPECT_TRUE(first.cancelled());
+    EXPECT_LT(calls.load(), 10000);
+
+    // Including partitioned lanes
+    calls = 0;
+    {
+        partitioned_streams lanes(
+            input.begin(), input.end(), [](int i) { return i; }, counted, 2,
+            options);
+        for (int i : lanes) {
+            (void)i;
+            break;
+        }
+    }
+    EXPECT_LT(calls.load(), 10000);
+}
+
+TEST(Functional, DestroyUnread) {
+    std::vector<int> input(100, 1);
+    auto identity = [](int i) { return i; };
+    stream_options options;
+    options.capacity = 4;
+
+    // Bounded stages that are never read would block on their full output
+    // forever, so destroying them cancels them
+    {
+        parallel_streams unread(input.begin(), input.end(), identity, 2,
+                                options);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    {
+        thread_pool threads(2);
+        parallel_streams unread(input.begin(), input.end(), identity, threads,
+                                options);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    {
+        partitioned_streams unread(input.begin(), input.end(), identity,
+                                   identity, 2, options);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // Unbounded ones still run to the end of their input
+    std::atomic<int> calls{0};
+    {
+        parallel_streams unread(input.begin(), input.end(),
+                                [&calls](int i) {
+                                    ++calls;
+                                    return i;
+                                },
+                                2);
+    }
+    EXPECT_EQ(calls.load(), 100);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include <psp/coroutine.hpp>
+#include <psp/stream_processor.hpp>
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace psp;
+
+coroutine_stage produce(int count, stream_queue<int>::writer output) {
+    for (int i = 1; i <= count; ++i)
+        co_await async_push(output, i);
+}
+
+coroutine_stage square(stream_queue<int> &input,
+                       stream_queue<int>::writer output) {
+    while (std::optional<int> item = co_await async_pop(input))
+        co_await async_push(output, *item * *item);
+}
+
+coroutine_stage sum(stream_queue<int> &input, std::atomic<int> &result,
+                    std::atomic<int> &finished) {
+    int total = 0;
+    while (std::optional<int> item = co_await async_pop(input))
+        total += *item;
+    result += total;
+    ++finished;
+}
+
+TEST(Coroutine, Pipeline) {
+    // Bounded queues so both pushes and pops suspend
+    stream_queue<int> numbers(2);
+    stream_queue<int> squares(2);
+    thread_pool threads(2);
+    spawn(threads, produce(100, numbers.make_writer()));
+    spawn(threads, square(numbers, squares.make_writer()));
+    int total = 0;
+    for (int item : squares)
+        total += item;
+    EXPECT_EQ(total, 338350);
+}
+
+TEST(Coroutine, ManyPipelines) {
+    // Far more stages than threads. None of them hold a thread while waiting.
+    const int pipelineCount = 500;
+    std::vector<std::unique_ptr<stream_queue<int>>> queues;
+    std::atomic<int> result{0};
+    std::atomic<int> finished{0};
+    thread_pool threads(2);
+    for (int i = 0; i < pipelineCount; ++i) {
+        queues.push_back(std::make_unique<stream_queue<int>>(1));
+        auto &numbers = *queues.back();
+        queues.push_back(std::make_unique<stream_queue<int>>(1));
+        auto &squares = *queues.back();
+        spawn(threads, sum(squares, result, finished));
+        spawn(threads, square(numbers, squares.make_writer()));
+        spawn(threads, produce(10, numbers.make_writer()));
+    }
+    while (finished.load() < pipelineCount)
+        std::this_thread::yield();
+    EXPECT_EQ(result.load(), pipelineCount * 385);
+}
+
+TEST(Coroutine, FeedsStreamProcessor) {
+    // Coroutine stages and C++17 stages can share a pool
+    stream_queue<int> numbers(4);
+    thread_pool threads(2);
+    spawn(threads, produce(100, numbers.make_writer()));
+    parallel_streams doubled(
+        numbers.begin(), numbers.end(), [](int i) { return i * 2; }, threads);
+    int total = 0;
+    for (int item : doubled)
+        total += item;
+    EXPECT_EQ(total, 10100);
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include <psp/file_sink.hpp>
+#include <psp/stream_processor.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using namespace psp;
+
+// A path that is deleted when the test ends
+class temp_path {
+public:
+    temp_path()
+        : m_path((std::filesystem::temp_directory_path() / unique_name())
+                     .string()) {}
+    ~temp_path() { std::remove(m_path.c_str()); }
+    const std::string &path() const { return m_path; }
+    std::string read() const {
+        std::ifstream file(m_path, std::ios::binary);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        return contents.str();
+    }
+
+private:
+    // ctest runs each test in its own process, possibly in parallel, so the
+    // name includes the test and process as well as a count within it
+    static std::string unique_name() {
+        const testing::TestInfo *test =
+            testing::UnitTest::GetInstance()->current_test_info();
+        return std::string("psp_sink_") + test->test_suite_name() + "_" +
+               test->name() + "_" + std::to_string(getpid()) + "_" +
+               std::to_string(++s_count) + ".txt";
+    }
+
+    static inline int s_count = 0;
+    std::string m_path;
+};
+
+static std::vector<std::string> lines(const std::string &str) {
+    std::vector<std::string> result;
+    std::istringstream stream(str);
+    for (std::string line; std::getline(stream, line);)
+        result.push_back(line);
+    return result;
+}
+
+TEST(FileSink, Basic) {
+    temp_path path;
+    {
+        file_sink<std::string> sink(path.path());
+        auto writer = sink.make_writer();
+        writer.push("hello");
+        writer.push(std::string("world"));
+    }
+    EXPECT_EQ(path.read(), "hello\nworld\n");
+
+    // Nothing written still creates the file
+    temp_path empty;
+    file_sink<int>(empty.path()).close();
+    EXPECT_TRUE(std::filesystem::exists(empty.path()));
+    EXPECT_EQ(empty.read(), "");
+
+    EXPECT_THROW(file_sink<int>("/nonexistent/psp/sink.txt"),
+                 std::system_error);
+}
+
+TEST(FileSink, CloseWaitsForWriters) {
+    temp_path path;
+    file_sink<int> sink(path.path());
+    std::thread late([writer = sink.make_writer()]() mutable {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        writer.push(42);
+    });
+    sink.close();
+    late.join();
+    EXPECT_EQ(path.read(), "42\n");
+}
+
+TEST(FileSink, SmallBlocksFromStages) {
+    temp_path path;
+    std::vector<int> input;
+    for (int i = 0; i < 10000; ++i)
+        input.push_back(i);
+    {
+        // Stage threads write straight to the sink with their own writers
+        file_sink_options options;
+        options.flush_bytes = 64;
+        options.capacity = 100;
+        file_sink<int> sink(path.path(), {}, options);
+        auto writer = sink.make_writer();
+        parallel_streams done(input.begin(), input.end(),
+                              [writer](int i) mutable {
+                                  writer.push(i);
+                                  return true;
+                              },
+                              4);
+        for (bool ok : done)
+            EXPECT_TRUE(ok);
+    }
+    std::vector<std::string> result = lines(path.read());
+    ASSERT_EQ(result.size(), input.size());
+    std::vector<int> values;
+    for (auto &line : result)
+        values.push_back(std::stoi(line));
+    std::sort(values.begin(), values.end());
+    EXPECT_EQ(values, input);
+}
+
+TEST(FileSink, Ordered) {
+    temp_path path;
+    auto serialize = [](const std::pair<int, char> &item, std::string &out) {
+        out += std::to_string(item.first);
+        out += item.second;
+    };
+    std::string expected;
+    {
+        file_sink_options options;
+        options.ordered = true;
+        options.flush_bytes = 10;
+        file_sink<std::pair<int, char>, decltype(serialize)> sink(
+            path.path(), serialize, options);
+
+        // Threads push interleaved indices
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 3; ++t)
+            threads.emplace_back([t, writer = sink.make_writer()]() mutable {
+                for (int i = 2 - t; i < 3000; i += 3)
+                    writer.push(size_t(i), std::make_pair(i, ','));
+            });
+        for (auto &thread : threads)
+            thread.join();
+        for (int i = 0; i < 3000; ++i)
+            expected += std::to_string(i) + ",";
+    }
+    EXPECT_EQ(path.read(), expected);
+}
+
+TEST(FileSink, ReorderWindow) {
+    temp_path path;
+    {
+        file_sink_options options;
+        options.ordered = true;
+        options.reorder_window = 2;
+        file_sink<int> sink(path.path(), {}, options);
+        auto writer = sink.make_writer();
+        writer.push(1, 1);
+
+        // Index 2 is outside the window until index 0 is written
+        std::atomic<bool> pushed{false};
+        std::thread ahead([&pushed, w = sink.make_writer()]() mutable {
+            w.push(2, 2);
+            pushed = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_FALSE(pushed.load());
+        writer.push(0, 0);
+        ahead.join();
+        EXPECT_TRUE(pushed.load());
+
+        // Indices already written are rejected
+        EXPECT_THROW(writer.push(0, 0), std::out_of_range);
+    }
+    EXPECT_EQ(path.read(), "0\n1\n2\n");
+}
+
+TEST(FileSink, MissingIndex) {
+    temp_path path;
+    file_sink_options options;
+    options.ordered = true;
+    file_sink<int> sink(path.path(), {}, options);
+    {
+        auto writer = sink.make_writer();
+        for (int i : {0, 1, 3, 4})
+            writer.push(size_t(i), i);
+    }
+
+    // Items after the gap cannot be written in order
+    try {
+        sink.close();
+        ADD_FAILURE() << "close() did not report the missing index";
+    } catch (const std::system_error &e) {
+        EXPECT_EQ(e.code().value(), EINVAL);
+        EXPECT_NE(std::string(e.what()).find("index 2"), std::string::npos);
+    }
+    EXPECT_EQ(path.read(), "0\n1\n");
+}
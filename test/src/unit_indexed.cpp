@@ -5,9 +5,11 @@
  * https://opensource.org/licenses/MIT.
  */
 
+#include <future>
 #include <gtest/gtest.h>
 #include <psp/indexed_processing.hpp>
 #include <psp/stream_processor.hpp>
+#include <thread>
 
 TEST(IndexedIterator, IteratorBasic) {
     std::vector<int> ints{0, 1, 2, 3};
@@ -45,3 +47,67 @@ TEST(IndexedIterator, FunctionEndToEnd) {
         EXPECT_EQ(result.step, 1);
     }
 }
+
+TEST(ReorderBuffer, ReleasesInOrder) {
+    psp::reorder_buffer<int> buffer(4);
+    std::vector<int> released;
+    auto release = [&](std::vector<int> &values) {
+        released.insert(released.end(), values.begin(), values.end());
+    };
+    EXPECT_TRUE(buffer.in_window(3));
+    EXPECT_FALSE(buffer.in_window(4));
+
+    std::vector<int> values{2, 3};
+    buffer.insert(2, values, release);
+    EXPECT_TRUE(released.empty());
+    values = {1};
+    buffer.insert(1, values, release);
+    EXPECT_TRUE(released.empty());
+    values = {0};
+    buffer.insert(0, values, release);
+    EXPECT_EQ(released, std::vector<int>({0, 1, 2, 3}));
+    EXPECT_TRUE(buffer.in_window(7));
+    EXPECT_FALSE(buffer.in_window(8));
+}
+
+TEST(ReorderBuffer, ReleasesWithoutLock) {
+    psp::reorder_buffer<int> buffer(4);
+    std::vector<int> released;
+    std::promise<void> entered, resume;
+    std::shared_future<void> resumed = resume.get_future().share();
+    std::thread releaser([&] {
+        std::vector<int> values{0};
+        buffer.insert(0, values, [&](std::vector<int> &run) {
+            bool first = released.empty();
+            released.insert(released.end(), run.begin(), run.end());
+            if (first) {
+                entered.set_value();
+                resumed.wait();
+            }
+        });
+    });
+    entered.get_future().wait();
+
+    // Returns while the first run is still being released, leaving the next
+    // to the releasing thread
+    std::vector<int> values{1};
+    buffer.insert(1, values, [](std::vector<int> &) { ADD_FAILURE(); });
+    resume.set_value();
+    releaser.join();
+    EXPECT_EQ(released, std::vector<int>({0, 1}));
+}
+
+TEST(ReorderBuffer, NotifyWhenInWindow) {
+    psp::reorder_buffer<int> buffer(2);
+    int notified = 0;
+    EXPECT_FALSE(buffer.notify_when_in_window(1, [&] { ++notified; }));
+    EXPECT_TRUE(buffer.notify_when_in_window(2, [&] { ++notified; }));
+    auto release = [](std::vector<int> &) {};
+    std::vector<int> values{1};
+    buffer.insert(1, values, release);
+    EXPECT_EQ(notified, 0);
+    values = {0};
+    buffer.insert(0, values, release);
+    EXPECT_EQ(notified, 1);
+    EXPECT_TRUE(buffer.in_window(2));
+}
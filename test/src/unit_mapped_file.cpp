@@ -0,0 +1,124 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include <psp/mapped_file.hpp>
+#include <psp/reduce.hpp>
+#include <psp/stream_processor.hpp>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using namespace psp;
+
+// Writes a file that is deleted when the test ends
+class temp_file {
+public:
+    explicit temp_file(const std::string &contents)
+        : m_path((std::filesystem::temp_directory_path() / unique_name())
+                     .string()) {
+        std::ofstream(m_path, std::ios::binary) << contents;
+    }
+    ~temp_file() { std::remove(m_path.c_str()); }
+    const std::string &path() const { return m_path; }
+
+private:
+    // ctest runs each test in its own process, possibly in parallel, so the
+    // name includes the test and process as well as a count within it
+    static std::string unique_name() {
+        const testing::TestInfo *test =
+            testing::UnitTest::GetInstance()->current_test_info();
+        return std::string("psp_test_") + test->test_suite_name() + "_" +
+               test->name() + "_" + std::to_string(getpid()) + "_" +
+               std::to_string(++s_count) + ".txt";
+    }
+
+    static inline int s_count = 0;
+    std::string m_path;
+};
+
+static std::vector<std::string> all_records(const record_file &file) {
+    std::vector<std::string> result;
+    for (record_chunk chunk : file)
+        for (std::string_view record : chunk)
+            result.emplace_back(record);
+    return result;
+}
+
+TEST(MappedFile, Contents) {
+    temp_file file("hello");
+    mapped_file mapped(file.path());
+    EXPECT_EQ(mapped.data(), "hello");
+
+    temp_file empty("");
+    EXPECT_EQ(mapped_file(empty.path()).size(), 0);
+    EXPECT_THROW(mapped_file("/nonexistent/psp"), std::system_error);
+}
+
+TEST(MappedFile, Lines) {
+    temp_file file("one\ntwo\n\nthree\nfour");
+    std::vector<std::string> expected{"one", "two", "", "three", "four"};
+
+    // Every chunk size, including ones splitting records and smaller than a
+    // record, gives the same records exactly once
+    for (std::size_t chunkBytes = 1; chunkBytes < 25; ++chunkBytes) {
+        record_file lines(file.path(), '\n', chunkBytes);
+        EXPECT_EQ(all_records(lines), expected) << chunkBytes;
+    }
+}
+
+TEST(MappedFile, FixedSize) {
+    temp_file file("aaabbbcccd");
+    std::vector<std::string> expected{"aaa", "bbb", "ccc", "d"};
+    for (std::size_t chunkBytes = 1; chunkBytes < 12; ++chunkBytes) {
+        auto records = record_file::fixed_size(file.path(), 3, chunkBytes);
+        EXPECT_EQ(all_records(records), expected) << chunkBytes;
+    }
+}
+
+TEST(MappedFile, ParallelRecords) {
+    std::string contents;
+    int expected = 0;
+    for (int i = 0; i < 10000; ++i) {
+        contents += std::to_string(i) + "\n";
+        expected += i % 7;
+    }
+    temp_file file(contents);
+    record_file lines(file.path(), '\n', 1000);
+
+    parallel_streams values(
+        lines.begin(), lines.end(),
+        flat_map([](const record_chunk &chunk, emitter<int> &emit) {
+            for (std::string_view line : chunk)
+                emit(std::stoi(std::string(line)) % 7);
+        }),
+        4);
+    int sum = 0;
+    for (int value : values)
+        sum += value;
+    EXPECT_EQ(sum, expected);
+
+    int lineCount = fold(
+        lines.begin(), lines.end(), 0,
+        [](int count, const record_chunk &chunk) {
+            return count + int(std::distance(chunk.begin(), chunk.end()));
+        },
+        [](int a, int b) { return a + b; }, 3, 1);
+    EXPECT_EQ(lineCount, 10000);
+}
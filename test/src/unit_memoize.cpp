@@ -0,0 +1,113 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include <psp/memoize.hpp>
+#include <psp/stream_processor.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace psp;
+
+TEST(Memoize, HitsAndEviction) {
+    concurrent_cache<int, int> cache(4, {}, {}, 1);
+    int calls = 0;
+    auto square = [&calls](int i) {
+        return [&calls, i] {
+            ++calls;
+            return i * i;
+        };
+    };
+    EXPECT_EQ(cache.get(3, square(3)), 9);
+    EXPECT_EQ(cache.get(3, square(3)), 9);
+    EXPECT_EQ(calls, 1);
+
+    // Key 3 was hit, so the clock passes it over and evicts 0
+    for (int i = 0; i < 3; ++i)
+        cache.get(i, square(i));
+    cache.get(3, square(3));
+    cache.get(10, square(10));
+    EXPECT_EQ(cache.size(), 4U);
+    cache.get(3, square(3));
+    EXPECT_EQ(calls, 5);
+
+    cache_stats stats = cache.stats();
+    EXPECT_EQ(stats.hits, 3U);
+    EXPECT_EQ(stats.misses, 5U);
+    EXPECT_EQ(stats.evictions, 1U);
+}
+
+TEST(Memoize, ExactCapacity) {
+    // Shards never add up to more than the requested capacity
+    for (size_t shards : {0, 1, 3, 12, 64}) {
+        for (size_t capacity : {1, 5, 7, 100, 1000}) {
+            concurrent_cache<int, int> cache(capacity, {}, {}, shards);
+            EXPECT_EQ(cache.capacity(), capacity);
+            for (int i = 0; i < 2000; ++i)
+                cache.get(i, [i] { return i; });
+            EXPECT_LE(cache.size(), capacity);
+        }
+    }
+}
+
+TEST(Memoize, SingleFlight) {
+    concurrent_cache<std::string, int> cache(16);
+    std::atomic<int> calls{0};
+    auto slow = [&calls] {
+        ++calls;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return 42;
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+        threads.emplace_back([&] { EXPECT_EQ(cache.get("key", slow), 42); });
+    for (auto &thread : threads)
+        thread.join();
+    EXPECT_EQ(calls.load(), 1);
+    cache_stats stats = cache.stats();
+    EXPECT_EQ(stats.misses, 1U);
+    EXPECT_EQ(stats.hits, 3U);
+}
+
+TEST(Memoize, Throws) {
+    concurrent_cache<int, int> cache(16);
+    EXPECT_THROW(cache.get(1, []() -> int { throw std::runtime_error("x"); }),
+                 std::runtime_error);
+
+    // Failures are not cached
+    EXPECT_EQ(cache.get(1, [] { return 1; }), 1);
+    EXPECT_EQ(cache.size(), 1U);
+}
+
+TEST(Memoize, Stage) {
+    std::vector<std::string> input;
+    for (int i = 0; i < 1000; ++i)
+        input.push_back("url" + std::to_string(i % 10));
+    std::atomic<int> calls{0};
+    auto length = memoize(
+        [&calls](const std::string &url) {
+            ++calls;
+            return url.size();
+        },
+        100);
+    parallel_streams lengths(input.begin(), input.end(), length, 4);
+    size_t total = 0;
+    for (size_t n : lengths)
+        total += n;
+    EXPECT_EQ(total, 4000U);
+    EXPECT_EQ(calls.load(), 10);
+
+    // The stage's copy shares the cache
+    cache_stats stats = length.stats();
+    EXPECT_EQ(stats.misses, 10U);
+    EXPECT_EQ(stats.hits, 990U);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+#include <psp/object_pool.hpp>
+#include <psp/stream_processor.hpp>
+
+#include <gtest/gtest.h>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace psp;
+
+TEST(ObjectPool, Reuse) {
+    object_pool<std::vector<int>> pool;
+    const int *data;
+    {
+        auto buffer = pool.acquire();
+        buffer->assign(100, 1);
+        data = buffer->data();
+    }
+    auto buffer = pool.acquire();
+    EXPECT_TRUE(buffer->empty());
+    EXPECT_GE(buffer->capacity(), 100U);
+    EXPECT_EQ(buffer->data(), data);
+    EXPECT_EQ(pool.created(), 1U);
+}
+
+TEST(ObjectPool, Release) {
+    object_pool<std::string> pool;
+    std::string kept;
+    {
+        auto text = pool.acquire();
+        *text = "kept";
+        kept = text.release();
+    }
+    EXPECT_EQ(kept, "kept");
+    pool.acquire();
+    EXPECT_EQ(pool.created(), 2U);
+}
+
+TEST(ObjectPool, CustomReset) {
+    auto reset = [](std::vector<int> &v) { v.assign(3, 7); };
+    object_pool<std::vector<int>, decltype(reset)> pool(4, reset);
+    pool.recycle(std::vector<int>{});
+    EXPECT_EQ(pool.take(), std::vector<int>(3, 7));
+    EXPECT_EQ(pool.created(), 0U);
+}
+
+TEST(ObjectPool, AcrossThreads) {
+    object_pool<std::vector<int>> pool;
+    std::vector<pooled<std::vector<int>>> items;
+    for (int i = 0; i < 10; ++i)
+        items.push_back(pool.acquire());
+    std::thread([&items] { items.clear(); }).join();
+
+    // Objects freed by the other thread are found again
+    for (int i = 0; i < 10; ++i)
+        items.push_back(pool.acquire());
+    EXPECT_EQ(pool.created(), 10U);
+}
+
+TEST(ObjectPool, Stage) {
+    object_pool<std::vector<int>> pool;
+    std::vector<int> input(10000);
+    std::iota(input.begin(), input.end(), 0);
+    stream_options options;
+    options.capacity = 8;
+    parallel_streams runner(
+        input.begin(), input.end(),
+        [&pool](int i) {
+            auto buffer = pool.acquire();
+            buffer->assign(64, i);
+            return buffer;
+        },
+        2, options);
+    long long sum = 0;
+    for (auto &buffer : runner)
+        sum += buffer->back();
+    EXPECT_EQ(sum, 10000LL * 9999 / 2);
+
+    // Only enough for the items in flight, not one per item
+    EXPECT_LT(pool.created(), 100U);
+}
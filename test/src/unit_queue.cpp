@@ -5,9 +5,14 @@
  * https://opensource.org/licenses/MIT.
  */
 
+#include <psp/ring_buffer.hpp>
 #include <psp/stream_queue.hpp>
 
+#include <chrono>
 #include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
 
 using namespace psp;
 
@@ -64,3 +69,283 @@ TEST(Queue, ComplexSkip) {
     // End should not block because there are no writers
     EXPECT_EQ(it, queue.end());
 }
+
+TEST(Queue, BoundedPushWaits) {
+    stream_queue<int> queue(2);
+    EXPECT_EQ(queue.capacity(), 2);
+    std::atomic<int> pushed{0};
+    std::thread producer([&, writer = queue.make_writer()]() mutable {
+        for (int i = 0; i < 10; ++i) {
+            writer.push(i);
+            ++pushed;
+        }
+    });
+    int expected = 0;
+    for (auto &item : queue) {
+        EXPECT_EQ(item, expected++);
+        EXPECT_LE(pushed.load(), expected + 2);
+    }
+    producer.join();
+    EXPECT_EQ(expected, 10);
+}
+
+TEST(Queue, TryPushWhenFull) {
+    stream_queue<int> queue(1);
+    auto writer = queue.make_writer();
+    EXPECT_TRUE(writer.try_push(1));
+    EXPECT_FALSE(writer.try_push(2));
+    EXPECT_EQ(queue.size(), 1);
+    EXPECT_EQ(queue.pop(), 1);
+    EXPECT_TRUE(writer.try_push(2));
+}
+
+TEST(Queue, PushRangePopN) {
+    stream_queue<int> queue(4);
+    auto writer = queue.make_writer();
+    std::vector<int> input{1, 2, 3, 4, 5, 6};
+    auto rest = writer.try_push_range(input.begin(), input.end());
+    EXPECT_EQ(rest - input.begin(), 4);
+    EXPECT_EQ(queue.size(), 4);
+
+    int output[3];
+    EXPECT_EQ(queue.pop_n(output, 3), 3);
+    EXPECT_EQ(output[0], 1);
+    EXPECT_EQ(output[2], 3);
+    writer.push_range(rest, input.end());
+
+    // Returns what is available without waiting for more
+    std::vector<int> remaining;
+    EXPECT_EQ(queue.pop_n(std::back_inserter(remaining), 10), 3);
+    EXPECT_EQ(remaining, std::vector<int>({4, 5, 6}));
+    EXPECT_EQ(queue.try_pop_n(output, 3), 0);
+}
+
+TEST(Queue, PopNUntil) {
+    using namespace std::chrono_literals;
+    stream_queue<int> queue;
+    std::vector<int> output;
+    {
+        auto writer = queue.make_writer();
+        writer.push(1);
+        writer.push(2);
+
+        // Times out short of a full batch
+        auto deadline = std::chrono::steady_clock::now() + 10ms;
+        EXPECT_EQ(queue.pop_n_until(std::back_inserter(output), 4, deadline),
+                  2);
+        EXPECT_GE(std::chrono::steady_clock::now(), deadline);
+
+        // Keeps waiting after the first item until the batch is full
+        std::thread pusher([&writer] {
+            for (int i = 3; i <= 6; ++i) {
+                std::this_thread::sleep_for(1ms);
+                writer.push(i);
+            }
+        });
+        EXPECT_EQ(queue.pop_n_until(std::back_inserter(output), 4,
+                                    std::chrono::steady_clock::now() + 10s),
+                  4);
+        pusher.join();
+    }
+    EXPECT_EQ(output, std::vector<int>({1, 2, 3, 4, 5, 6}));
+
+    // Returns early once the stream ends
+    EXPECT_EQ(queue.pop_n_until(std::back_inserter(output), 4,
+                                std::chrono::steady_clock::now() + 10s),
+              0);
+}
+
+TEST(Queue, Cancel) {
+    stream_queue<int> queue(1);
+    auto writer = queue.make_writer();
+    writer.push(1);
+    bool cancelledCalled = false;
+    queue.on_cancel([&cancelledCalled] { cancelledCalled = true; });
+
+    // Wakes a writer waiting for space
+    std::thread pusher([&writer] { writer.push(2); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    queue.cancel();
+    pusher.join();
+    EXPECT_TRUE(cancelledCalled);
+    EXPECT_TRUE(writer.cancelled());
+
+    // Pops see the end of the stream even with a writer open and an item
+    // still queued, and pushes are dropped
+    EXPECT_TRUE(writer.try_push(3));
+    EXPECT_EQ(queue.pop(), std::nullopt);
+    EXPECT_TRUE(queue.finished());
+    EXPECT_EQ(queue.begin(), queue.end());
+    EXPECT_FALSE(queue.notify_when_ready([] {}));
+}
+
+TEST(Queue, IteratorPopN) {
+    stream_queue<int> queue;
+    auto it = queue.begin();
+    std::vector<int> output;
+    {
+        auto writer = queue.make_writer();
+        std::vector<int> input{1, 2, 3};
+        writer.push_range(input.begin(), input.end());
+        EXPECT_EQ(*it, 1); // reads the first value into the iterator
+        EXPECT_EQ(it.pop_n(std::back_inserter(output), 2), 2);
+        EXPECT_EQ(output, std::vector<int>({1, 2}));
+        EXPECT_EQ(*it, 3);
+    }
+    EXPECT_EQ(it.pop_n(std::back_inserter(output), 2), 1);
+    EXPECT_EQ(it.pop_n(std::back_inserter(output), 2), 0);
+    EXPECT_EQ(it, queue.end());
+}
+
+TEST(Queue, IteratorTryPop) {
+    stream_queue<int> queue;
+    auto it = queue.begin();
+    {
+        auto writer = queue.make_writer();
+        EXPECT_FALSE(it.try_pop());
+        EXPECT_FALSE(it.ended());
+        writer.push(1);
+        EXPECT_EQ(it.try_pop(), 1);
+        writer.push(2);
+    }
+    EXPECT_FALSE(it.ended());
+    EXPECT_EQ(it.try_pop(), 2);
+    EXPECT_FALSE(it.try_pop());
+    EXPECT_TRUE(it.ended());
+}
+
+TEST(Queue, NotifyWhenReady) {
+    stream_queue<int> queue(1);
+    int ready = 0;
+    int space = 0;
+    {
+        auto writer = queue.make_writer();
+        EXPECT_TRUE(queue.notify_when_ready([&] { ++ready; }));
+        writer.push(1);
+        EXPECT_EQ(ready, 1);
+
+        // Already ready, or full, so the callbacks are not kept
+        EXPECT_FALSE(queue.notify_when_ready([&] { ++ready; }));
+        EXPECT_TRUE(writer.notify_when_space([&] { ++space; }));
+        EXPECT_EQ(queue.pop(), 1);
+        EXPECT_EQ(space, 1);
+        EXPECT_FALSE(writer.notify_when_space([&] { ++space; }));
+        EXPECT_TRUE(queue.notify_when_ready([&] { ++ready; }));
+    }
+
+    // Closing the queue also calls them
+    EXPECT_EQ(ready, 2);
+    EXPECT_FALSE(queue.notify_when_ready([&] { ++ready; }));
+    EXPECT_EQ(space, 1);
+}
+
+TEST(Queue, DrainBatches) {
+    stream_queue<int> queue;
+    std::thread producer([writer = queue.make_writer()]() mutable {
+        std::vector<int> batch;
+        for (int i = 0; i < 1000; ++i) {
+            batch.push_back(i);
+            if (batch.size() == 7) {
+                writer.push_range(batch.begin(), batch.end());
+                batch.clear();
+            }
+        }
+        writer.push_range(batch.begin(), batch.end());
+    });
+    int expected = 0;
+    for (auto &item : queue.drain(16))
+        EXPECT_EQ(item, expected++);
+    producer.join();
+    EXPECT_EQ(expected, 1000);
+}
+
+template <class Buffer> class RingBufferTest : public ::testing::Test {};
+using RingBuffers =
+    ::testing::Types<spsc_ring_buffer<int>, mpsc_ring_buffer<int>,
+                     mpmc_ring_buffer<int>>;
+TYPED_TEST_SUITE(RingBufferTest, RingBuffers);
+
+TYPED_TEST(RingBufferTest, FillAndDrain) {
+    TypeParam buffer(3);
+    EXPECT_EQ(buffer.capacity(), 4); // rounded up to a power of two
+    for (int i = 0; i < 4; ++i)
+        EXPECT_TRUE(buffer.try_push(i));
+    EXPECT_FALSE(buffer.try_push(4));
+    EXPECT_EQ(buffer.size(), 4);
+    for (int i = 0; i < 4; ++i)
+        EXPECT_EQ(buffer.try_pop(), i);
+    EXPECT_FALSE(buffer.try_pop());
+    EXPECT_EQ(buffer.size(), 0);
+
+    // Wrap around
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_TRUE(buffer.try_push(i));
+        EXPECT_EQ(buffer.try_pop(), i);
+    }
+}
+
+TYPED_TEST(RingBufferTest, Batches) {
+    TypeParam buffer(4);
+    std::vector<int> input{1, 2, 3, 4, 5, 6};
+    auto rest = buffer.try_push_range(input.begin(), input.end());
+    EXPECT_EQ(rest - input.begin(), 4);
+    int output[6];
+    EXPECT_EQ(buffer.try_pop_n(output, 3), 3);
+    EXPECT_EQ(buffer.try_push_range(rest, input.end()), input.end());
+    EXPECT_EQ(buffer.try_pop_n(output + 3, 6), 3);
+    for (int i = 0; i < 6; ++i)
+        EXPECT_EQ(output[i], i + 1);
+    EXPECT_EQ(buffer.try_pop_n(output, 6), 0);
+}
+
+TYPED_TEST(RingBufferTest, LastWriterUnblocks) {
+    stream_queue<int, TypeParam> queue(2);
+    std::thread producer([writer = queue.make_writer()]() mutable {
+        // More than the capacity, so push() must wait for the reader
+        for (int i = 0; i < 100; ++i)
+            writer.push(i);
+    });
+    int sum = 0;
+    for (auto &item : queue)
+        sum += item;
+    producer.join();
+    EXPECT_EQ(sum, 4950);
+}
+
+TEST(Queue, FailedPushDoesNotMove) {
+    mpmc_ring_buffer<std::unique_ptr<int>> buffer(2);
+    EXPECT_TRUE(buffer.try_push(std::make_unique<int>(1)));
+    EXPECT_TRUE(buffer.try_push(std::make_unique<int>(2)));
+    auto value = std::make_unique<int>(3);
+    EXPECT_FALSE(buffer.try_push(std::move(value)));
+    ASSERT_TRUE(value);
+    EXPECT_EQ(*value, 3);
+}
+
+TEST(Queue, ManyProducersManyConsumers) {
+    const int producers = 4;
+    const int consumers = 4;
+    const int perProducer = 10000;
+    stream_queue<int, mpmc_ring_buffer<int>> queue(16);
+    std::vector<std::thread> threads;
+    {
+        auto writer = queue.make_writer();
+        for (int p = 0; p < producers; ++p)
+            threads.emplace_back([writer]() mutable {
+                for (int i = 1; i <= perProducer; ++i)
+                    writer.push(i);
+            });
+    }
+    std::atomic<long long> sum{0};
+    for (int c = 0; c < consumers; ++c)
+        threads.emplace_back([&] {
+            long long local = 0;
+            while (auto value = queue.pop())
+                local += *value;
+            sum += local;
+        });
+    for (auto &thread : threads)
+        thread.join();
+    EXPECT_EQ(sum, (long long)producers * perProducer * (perProducer + 1) / 2);
+    EXPECT_EQ(queue.size(), 0);
+}
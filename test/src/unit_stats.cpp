@@ -0,0 +1,145 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+// Built into its own executable with PSP_ENABLE_STATS=1
+#include <psp/stream_processor.hpp>
+#include <psp/thread_pool.hpp>
+
+#include <chrono>
+#include <gtest/gtest.h>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+using namespace psp;
+
+static_assert(stats_enabled, "stats_tests must define PSP_ENABLE_STATS=1");
+
+TEST(Stats, Queue) {
+    stream_queue<int> queue(4);
+    {
+        auto writer = queue.make_writer();
+        writer.push(1);
+        writer.push(2);
+        writer.push(3);
+        queue.pop();
+        writer.push(4);
+    }
+    while (queue.pop())
+        ;
+    queue_stats stats = queue.stats();
+    EXPECT_EQ(stats.pushed, 4);
+    EXPECT_EQ(stats.popped, 4);
+    EXPECT_EQ(stats.high_water, 3);
+}
+
+TEST(Stats, QueueWaits) {
+    stream_queue<int> queue(1);
+    std::thread reader([&queue]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        while (queue.pop())
+            ;
+    });
+    {
+        auto writer = queue.make_writer();
+        writer.push(1);
+        writer.push(2); // full until the reader wakes
+    }
+    reader.join();
+    queue_stats stats = queue.stats();
+    EXPECT_GT(stats.push_wait_ns, 0);
+    EXPECT_EQ(stats.popped, 2);
+}
+
+TEST(Stats, Stage) {
+    std::vector<int> input(1000);
+    std::iota(input.begin(), input.end(), 0);
+    parallel_streams processor(input.begin(), input.end(),
+                               [](int i) { return i * 2; }, 2);
+    size_t count = 0;
+    for (int i : processor) {
+        (void)i;
+        ++count;
+    }
+    EXPECT_EQ(count, input.size());
+    stage_stats stats = processor.stats();
+    EXPECT_EQ(stats.items_in, input.size());
+    EXPECT_EQ(stats.items_out, input.size());
+    EXPECT_EQ(stats.output.pushed, input.size());
+    EXPECT_EQ(stats.output.popped, input.size());
+    EXPECT_GT(stats.function_ns, 0);
+}
+
+TEST(Stats, GuidedChunks) {
+    // The first chunk claimed is a share of the input per stage thread,
+    // however many cores there are
+    std::vector<int> input(1200);
+    std::iota(input.begin(), input.end(), 0);
+    parallel_streams processor(input.begin(), input.end(),
+                               [](int i) { return i * 2; }, 3);
+    size_t count = 0;
+    for (int i : processor) {
+        (void)i;
+        ++count;
+    }
+    EXPECT_EQ(count, input.size());
+    EXPECT_EQ(processor.stats().batch_size.max, input.size() / (2 * 3));
+}
+
+TEST(Stats, Workers) {
+    std::vector<int> input(1000);
+    std::iota(input.begin(), input.end(), 0);
+    thread_pool threads(2);
+    parallel_streams processor(input.begin(), input.end(),
+                               [](int i) { return i + 1; }, threads);
+    size_t count = 0;
+    for (int i : processor) {
+        (void)i;
+        ++count;
+    }
+    EXPECT_EQ(count, input.size());
+    EXPECT_EQ(processor.stats().items_in, input.size());
+    std::vector<worker_stats> stats = threads.stats();
+    ASSERT_EQ(stats.size(), 2);
+    uint64_t calls = 0;
+    for (const worker_stats &worker : stats)
+        calls += worker.calls;
+    EXPECT_GT(calls, 0);
+}
+
+TEST(Stats, BatchTimeout) {
+    using namespace std::chrono_literals;
+    stream_queue<int> queue;
+    stream_options options;
+    options.batch_size = 8;
+    options.batch_timeout = 2ms;
+    parallel_streams processor(queue.begin(), queue.end(),
+                               [](int i) { return i + 1; }, 1, options);
+    {
+        // Full batches, then a trickle that times out in partial ones
+        auto writer = queue.make_writer();
+        for (int i = 0; i < 64; ++i)
+            writer.push(i);
+        std::this_thread::sleep_for(10ms);
+        for (int i = 0; i < 4; ++i) {
+            writer.push(i);
+            std::this_thread::sleep_for(5ms);
+        }
+    }
+    size_t count = 0;
+    for (int i : processor) {
+        (void)i;
+        ++count;
+    }
+    EXPECT_EQ(count, 68);
+    stage_stats stats = processor.stats();
+    EXPECT_EQ(stats.batch_size.sum, 68);
+    EXPECT_EQ(stats.batch_size.max, 8);
+    EXPECT_LE(stats.batch_size.percentile(0.0), 2);
+    EXPECT_GT(stats.batch_wait_ns.count, 0);
+    EXPECT_GE(stats.batch_wait_ns.max, 2000000);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2022 Pyarelal Knowles
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT.
+ */
+
+// Built into its own executable with PSP_ENABLE_TRACE=1
+#include <psp/stream_processor.hpp>
+#include <psp/thread_pool.hpp>
+#include <psp/trace.hpp>
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace psp;
+
+static_assert(trace_enabled, "trace_tests must define PSP_ENABLE_TRACE=1");
+
+static size_t count(const std::string &str, const std::string &substr) {
+    size_t result = 0;
+    for (size_t pos = str.find(substr); pos != std::string::npos;
+         pos = str.find(substr, pos + 1))
+        ++result;
+    return result;
+}
+
+TEST(Trace, Pipeline) {
+    std::vector<int> input(100);
+    std::iota(input.begin(), input.end(), 0);
+    std::ostringstream json;
+    {
+        trace_session session;
+        {
+            thread_pool threads(2);
+            stream_options options;
+            options.name = "add \"one\"";
+            parallel_streams processor(input.begin(), input.end(),
+                                       [](int i) { return i + 1; }, threads,
+                                       options);
+            int sum = 0;
+            for (int i : processor)
+                sum += i;
+            EXPECT_EQ(sum, 5050);
+        }
+        session.write(json);
+    }
+    std::string trace = json.str();
+    EXPECT_EQ(trace.rfind("{\"traceEvents\":[", 0), 0);
+    EXPECT_NE(trace.find("\"psp worker\""), std::string::npos);
+    EXPECT_GT(count(trace, "\"name\":\"task\""), 0);
+    EXPECT_GT(count(trace, "\"name\":\"add \\\"one\\\"\""), 0);
+
+    // One size sample per push and per pop
+    EXPECT_GE(count(trace, "\"name\":\"queue size\""), 200);
+}
+
+TEST(Trace, OnlyWhileRecording) {
+    stream_queue<int> queue;
+    {
+        auto writer = queue.make_writer();
+        writer.push(1);
+    }
+    queue.pop();
+
+    trace_session session;
+    std::ostringstream json;
+    session.write(json);
+    EXPECT_EQ(count(json.str(), "\"name\":\"queue size\""), 0);
+}
+
+TEST(Trace, FreesBuffers) {
+    auto &registry = detail::trace_registry::instance();
+    size_t before = registry.buffers().size();
+
+    // Naming a thread does not create a buffer
+    {
+        thread_pool threads(2);
+    }
+    EXPECT_EQ(registry.buffers().size(), before);
+
+    // Exited threads' events stay until the session ends
+    std::ostringstream json;
+    {
+        trace_session session;
+        {
+            std::atomic<bool> ran{false};
+            thread_pool threads(2);
+            threads.process(
+                [&ran]() {
+                    ran = true;
+                    return false;
+                },
+                1);
+            while (!ran)
+                std::this_thread::yield();
+        }
+        EXPECT_GT(registry.buffers().size(), before);
+        session.write(json);
+    }
+    EXPECT_GT(count(json.str(), "\"name\":\"task\""), 0);
+    EXPECT_TRUE(registry.buffers().empty());
+
+    // A running thread starts a new buffer in the next session, without
+    // the previous session's events
+    stream_queue<int> queue;
+    {
+        trace_session first;
+        queue.make_writer().push(1);
+    }
+    EXPECT_TRUE(registry.buffers().empty());
+    std::uint64_t start = detail::stats_now_ns();
+    trace_session second;
+    queue.pop();
+    auto buffers = registry.buffers();
+    ASSERT_EQ(buffers.size(), 1);
+    size_t events = 0;
+    buffers[0]->for_each([&](const detail::trace_event &event) {
+        EXPECT_GE(event.start_ns, start);
+        ++events;
+    });
+    EXPECT_GT(events, 0);
+}